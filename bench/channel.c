@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../tests/producer-consumer.h"
+
+enum { PRODUCERS = 2, CONSUMERS = 2, CAP = 100, BATCH = 64 };
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int per_producer;
+static Item *items;
+static int produced; // items are handed out in order, an Item can only be queued once
+static long consumed;
+static int running;
+
+// The pattern of tests/producer-consumer.c before channels: poll the queue, yield on every iteration.
+static void spin_producer(void *arg) {
+  Queue *queue = arg;
+  for (int i = 0; i < per_producer;) {
+    if (!q_is_full(queue)) {
+      q_push(queue, &items[produced++]);
+      i++;
+    }
+    co_yield();
+  }
+}
+
+static void spin_consumer(void *arg) {
+  Queue *queue = arg;
+  while (running || !q_is_empty(queue)) {
+    if (!q_is_empty(queue)) {
+      q_pop(queue);
+      consumed++;
+    }
+    co_yield();
+  }
+}
+
+static void chan_producer(void *arg) {
+  co_chan_t *chan = arg;
+  for (int i = 0; i < per_producer; i++) {
+    Item *item = &items[produced++];
+    co_chan_send(chan, &item);
+  }
+}
+
+static void chan_consumer(void *arg) {
+  co_chan_t *chan = arg;
+  Item *item;
+  while (co_chan_recv(chan, &item) == 0) {
+    consumed++;
+  }
+}
+
+static void batch_producer(void *arg) {
+  co_chan_t *chan = arg;
+  Item *batch[BATCH];
+  for (int i = 0; i < per_producer; i += BATCH) {
+    int n = per_producer - i < BATCH ? per_producer - i : BATCH;
+    for (int j = 0; j < n; j++) {
+      batch[j] = &items[produced++];
+    }
+    co_chan_send_n(chan, batch, n);
+  }
+}
+
+static void batch_consumer(void *arg) {
+  co_chan_t *chan = arg;
+  Item *batch[BATCH];
+  size_t n;
+  while ((n = co_chan_recv_n(chan, batch, BATCH)) > 0) {
+    consumed += n;
+  }
+}
+
+static void run(const char *mode, void (*producer)(void *), void (*consumer)(void *), void *arg, co_chan_t *chan) {
+  consumed = 0;
+  produced = 0;
+  running = 1;
+  coroutine_t *cos[PRODUCERS + CONSUMERS];
+  double start = now_ns();
+  for (int i = 0; i < PRODUCERS; i++) {
+    cos[i] = co_start("producer", producer, arg);
+  }
+  for (int i = 0; i < CONSUMERS; i++) {
+    cos[PRODUCERS + i] = co_start("consumer", consumer, arg);
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    co_wait(cos[i]);
+  }
+  running = 0;
+  if (chan != NULL) {
+    co_chan_close(chan);
+  }
+  for (int i = PRODUCERS; i < PRODUCERS + CONSUMERS; i++) {
+    co_wait(cos[i]);
+  }
+  double elapsed = now_ns() - start;
+  for (int i = 0; i < PRODUCERS + CONSUMERS; i++) {
+    co_free(cos[i]);
+  }
+  if (consumed != (long) PRODUCERS * per_producer) {
+    fprintf(stderr, "%s: %ld items consumed\n", mode, consumed);
+    exit(1);
+  }
+  printf("%-12s %8.1f ns/item %12.0f items/s\n", mode, elapsed / consumed, consumed / elapsed * 1e9);
+}
+
+int main(int argc, char *argv[]) {
+  per_producer = argc > 1 ? atoi(argv[1]) : 500000;
+  items = calloc((size_t) PRODUCERS * per_producer, sizeof(Item));
+
+  Queue *queue = q_new();
+  run("spin", spin_producer, spin_consumer, queue, NULL);
+  free(queue);
+
+  co_chan_t *chan = co_chan_new(sizeof(Item *), CAP);
+  run("chan", chan_producer, chan_consumer, chan, chan);
+  co_chan_free(chan);
+
+  chan = co_chan_new(sizeof(Item *), 0);
+  run("unbuffered", chan_producer, chan_consumer, chan, chan);
+  co_chan_free(chan);
+
+  chan = co_chan_new(sizeof(Item *), CAP);
+  run("batch", batch_producer, batch_consumer, chan, chan);
+  co_chan_free(chan);
+
+  free(items);
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+enum { COPIERS = 8 };
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int src_fd, dst_fd;
+static long file_size;
+static long chunk;
+
+static void check(ssize_t n, const char *what) {
+  if (n <= 0) {
+    perror(what);
+    exit(1);
+  }
+}
+
+static void copy_blocking() {
+  char *buf = malloc(chunk);
+  for (long off = 0; off < file_size;) {
+    ssize_t n = pread(src_fd, buf, chunk, off);
+    check(n, "pread");
+    check(pwrite(dst_fd, buf, n, off), "pwrite");
+    off += n;
+  }
+  free(buf);
+}
+
+// Each copier takes every COPIERS-th chunk, so that the operations of a round are submitted together.
+static void copier(void *arg) {
+  char *buf = malloc(chunk);
+  for (long off = (long) arg * chunk; off < file_size; off += COPIERS * chunk) {
+    ssize_t n = co_pread(src_fd, buf, chunk, off);
+    check(n, "co_pread");
+    check(co_pwrite(dst_fd, buf, n, off), "co_pwrite");
+  }
+  free(buf);
+}
+
+static void copy_coroutines() {
+  coroutine_t *cos[COPIERS];
+  for (long i = 0; i < COPIERS; i++) {
+    cos[i] = co_start("copier", copier, (void *) i);
+  }
+  for (int i = 0; i < COPIERS; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+}
+
+static void run(const char *mode, void (*copy)()) {
+  double start = now_ns();
+  copy();
+  double elapsed = now_ns() - start;
+  printf("%-12s %8.1f ms %10.1f MB/s %8.0f ns/chunk\n", mode, elapsed / 1e6, file_size / elapsed * 1e3,
+         elapsed / (file_size / chunk));
+}
+
+static int temp_file() {
+  char path[] = "/tmp/bench-file-copy-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  unlink(path);
+  return fd;
+}
+
+// Copies a file of argv[1] MB (64 by default) in the page cache by chunks of argv[2] KB (4 by default): with
+// pread/pwrite, with COPIERS coroutines through io_uring, and with the same coroutines falling back to the blocking
+// syscalls. The file is copied once beforehand so that the destination has its pages already.
+int main(int argc, char *argv[]) {
+  file_size = (argc > 1 ? atol(argv[1]) : 64) << 20;
+  chunk = (argc > 2 ? atol(argv[2]) : 4) << 10;
+  src_fd = temp_file();
+  dst_fd = temp_file();
+  char *data = malloc(chunk);
+  memset(data, 'x', chunk);
+  for (long off = 0; off < file_size; off += chunk) {
+    check(pwrite(src_fd, data, chunk, off), "pwrite");
+  }
+  free(data);
+  copy_blocking();
+  run("blocking", copy_blocking);
+  if (co_io_uring(1) == 0) {
+    run("io_uring", copy_coroutines);
+  } else {
+    printf("io_uring is not available\n");
+  }
+  co_io_uring(0);
+  run("fallback", copy_coroutines);
+  close(src_fd);
+  close(dst_fd);
+  return 0;
+}
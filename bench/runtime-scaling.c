@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int rounds;
+static int spin;
+
+// Some work between switches, so that more workers have something to win.
+static void yield_work(void *arg) {
+  volatile unsigned long x = 0;
+  for (int i = 0; i < rounds; i++) {
+    for (int j = 0; j < spin; j++) {
+      x += j;
+    }
+    co_yield();
+  }
+}
+
+// Spawns its children from a worker, so that idle workers have to steal them.
+static void fan_out(void *arg) {
+  int m = *(int *) arg;
+  coroutine_t **cos = malloc(sizeof(coroutine_t *) * m);
+  for (int i = 0; i < m; i++) {
+    cos[i] = co_start("yield", yield_work, NULL);
+  }
+  for (int i = 0; i < m; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  free(cos);
+}
+
+int main(int argc, char *argv[]) {
+  int m = argc > 1 ? atoi(argv[1]) : 256;
+  rounds = argc > 2 ? atoi(argv[2]) : 2000;
+  spin = argc > 3 ? atoi(argv[3]) : 200;
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int workers = 1; workers <= cores; workers++) {
+    co_runtime_start(workers);
+    double start = now_ns();
+    coroutine_t *root = co_start("fan-out", fan_out, &m);
+    co_wait(root);
+    co_free(root);
+    double elapsed = now_ns() - start;
+    co_runtime_stop();
+    printf("%3d workers: %8.1f ms   %8.1f ns/switch   %10.0f switches/s\n", workers, elapsed / 1e6,
+           elapsed / ((double) m * rounds), (double) m * rounds / elapsed * 1e9);
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "coroutine.h"
+
+static long rss_kb() {
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      kb = strtol(line + 6, NULL, 10);
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  return kb;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// A parked connection: some state on the stack, then waiting to be scheduled again.
+static void idle_work(void *arg) {
+  volatile char frame[1024];
+  memset((char *) frame, 1, sizeof(frame));
+  co_yield();
+}
+
+static int rounds;
+
+static void yield_work(void *arg) {
+  volatile char frame[256];
+  memset((char *) frame, 1, sizeof(frame));
+  for (int i = 0; i < rounds; i++) {
+    co_yield();
+  }
+}
+
+static void bench(const char *mode, const co_attr_t *attr, int n, int m) {
+  coroutine_t **cos = malloc(sizeof(coroutine_t *) * n);
+  long before = rss_kb();
+  for (int i = 0; i < n; i++) {
+    cos[i] = co_start_ex("idle", idle_work, NULL, attr);
+  }
+  co_yield(); // every coroutine runs once and parks
+  long parked = rss_kb();
+  for (int i = 0; i < n; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+
+  double start = now_ns();
+  for (int i = 0; i < m; i++) {
+    cos[i] = co_start_ex("yield", yield_work, NULL, attr);
+  }
+  for (int i = 0; i < m; i++) {
+    co_wait(cos[i]);
+  }
+  double elapsed = now_ns() - start;
+  for (int i = 0; i < m; i++) {
+    co_free(cos[i]);
+  }
+  free(cos);
+
+  printf("%-10s %8d parked: %8.2f KB/coroutine   %4d yielding: %8.1f ns/switch\n",
+         mode, n, (double) (parked - before) / n, m, elapsed / ((double) m * (rounds + 1)));
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 20000; // dedicated stacks take two mappings each, mind vm.max_map_count
+  int m = argc > 2 ? atoi(argv[2]) : 64;
+  rounds = argc > 3 ? atoi(argv[3]) : 10000;
+  co_attr_t shared = {.stack_kind = CO_STACK_SHARED};
+  bench("dedicated", NULL, n, m);
+  bench("shared", &shared, n, m);
+  return 0;
+}
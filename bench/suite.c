@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "coroutine.h"
+
+// Every benchmark times SAMPLES batches of BATCH operations, and reports the percentiles of the time per operation.
+enum { SAMPLES = 1000, BATCH = 100, FAN_IN = 1000, CHAN_CAP = 100 };
+
+static long rss_kb() {
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      kb = strtol(line + 6, NULL, 10);
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  return kb;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double samples[SAMPLES];
+static int sampled;
+static double last;
+
+// Records the time per operation of the batch of ops operations since the last sample.
+static void sample(int ops) {
+  double t = now_ns();
+  samples[sampled++] = (t - last) / ops;
+  last = t;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank, on sorted samples.
+static double percentile(double p) {
+  int rank = (int) (p / 100 * sampled + 0.999999);
+  return samples[rank > 1 ? rank - 1 : 0];
+}
+
+static int reported;
+
+static void report(const char *name, int ops, const char *extra) {
+  double sum = 0;
+  for (int i = 0; i < sampled; i++) {
+    sum += samples[i];
+  }
+  qsort(samples, sampled, sizeof(double), cmp_double);
+  printf("%s    {\"name\": \"%s\", \"unit\": \"ns/op\", \"samples\": %d, \"ops_per_sample\": %d, "
+         "\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f%s}",
+         reported++ > 0 ? ",\n" : "", name, sampled, ops, sum / sampled, percentile(50), percentile(90),
+         percentile(99), percentile(99.9), samples[sampled - 1], extra != NULL ? extra : "");
+  sampled = 0;
+}
+
+// Two coroutines yielding to each other: an operation is a switch.
+static void ping_pong(void *arg) {
+  int timed = arg != NULL;
+  for (int i = 0; i < SAMPLES; i++) {
+    for (int j = 0; j < BATCH / 2; j++) {
+      co_yield();
+    }
+    if (timed) {
+      sample(BATCH);
+    }
+  }
+}
+
+static int stop;
+
+static void resumed(void *arg) {
+  while (!stop) {
+    co_yield();
+  }
+}
+
+static void nothing(void *arg) {
+}
+
+static void yield_once(void *arg) {
+  co_yield();
+}
+
+static void chan_producer(void *arg) {
+  co_chan_t *chan = arg;
+  for (long i = 0; i < (long) SAMPLES * BATCH; i++) {
+    co_chan_send(chan, &i);
+  }
+  co_chan_close(chan);
+}
+
+static void chan_consumer(void *arg) {
+  co_chan_t *chan = arg;
+  long v;
+  for (long n = 1; co_chan_recv(chan, &v) == 0; n++) {
+    if (n % BATCH == 0) {
+      sample(BATCH);
+    }
+  }
+}
+
+static void bench_yield() {
+  coroutine_t *a = co_start("ping", ping_pong, (void *) 1);
+  coroutine_t *b = co_start("pong", ping_pong, NULL);
+  last = now_ns();
+  co_wait(a);
+  co_wait(b);
+  co_free(a);
+  co_free(b);
+  report("yield_switch", BATCH, NULL);
+}
+
+static void bench_resume() {
+  stop = 0;
+  coroutine_t *co = co_start("resumed", resumed, NULL);
+  co_resume(co);
+  for (int i = 0; i < SAMPLES; i++) {
+    last = now_ns();
+    for (int j = 0; j < BATCH; j++) {
+      co_resume(co); // back to main when co yields
+    }
+    sample(BATCH);
+  }
+  stop = 1;
+  co_wait(co);
+  co_free(co);
+  report("resume_round_trip", BATCH, NULL);
+}
+
+static void bench_spawn() {
+  last = now_ns();
+  for (int i = 0; i < SAMPLES; i++) {
+    for (int j = 0; j < BATCH; j++) {
+      coroutine_t *co = co_start("nothing", nothing, NULL);
+      co_wait(co);
+      co_free(co);
+    }
+    sample(BATCH);
+  }
+  report("start_run_free", BATCH, NULL);
+}
+
+// An operation is a co_wait on one of FAN_IN coroutines, all of them parked once.
+static void bench_fan_in() {
+  static coroutine_t *cos[FAN_IN];
+  for (int i = 0; i < SAMPLES / 10; i++) {
+    for (int j = 0; j < FAN_IN; j++) {
+      cos[j] = co_start("yield_once", yield_once, NULL);
+    }
+    last = now_ns();
+    for (int j = 0; j < FAN_IN; j++) {
+      co_wait(cos[j]);
+    }
+    sample(FAN_IN);
+    for (int j = 0; j < FAN_IN; j++) {
+      co_free(cos[j]);
+    }
+  }
+  report("wait_fan_in", FAN_IN, NULL);
+}
+
+static void bench_chan() {
+  co_chan_t *chan = co_chan_new(sizeof(long), CHAN_CAP);
+  coroutine_t *producer = co_start("producer", chan_producer, chan);
+  coroutine_t *consumer = co_start("consumer", chan_consumer, chan);
+  double start = now_ns();
+  last = start;
+  co_wait(producer);
+  co_wait(consumer);
+  double elapsed = now_ns() - start;
+  co_free(producer);
+  co_free(consumer);
+  co_chan_free(chan);
+  char extra[64];
+  snprintf(extra, sizeof(extra), ", \"items_per_sec\": %.0f", (double) SAMPLES * BATCH / elapsed * 1e9);
+  report("producer_consumer", BATCH, extra);
+}
+
+// Spawn to completion of FAN_IN coroutines that yield once, started one by one or as a batch: an operation is a
+// coroutine.
+static void bench_fan_out(bool batch) {
+  static coroutine_t *cos[FAN_IN];
+  co_stack_pool_config(64, 0); // most of the stacks have to be mapped, as in a burst
+  for (int i = 0; i < SAMPLES / 10; i++) {
+    last = now_ns();
+    if (batch) {
+      co_start_batch(cos, FAN_IN, "yield_once", yield_once, NULL, NULL);
+    } else {
+      for (int j = 0; j < FAN_IN; j++) {
+        cos[j] = co_start("yield_once", yield_once, NULL);
+      }
+    }
+    for (int j = 0; j < FAN_IN; j++) {
+      co_wait(cos[j]);
+    }
+    sample(FAN_IN);
+    if (batch) {
+      co_free_batch(cos, FAN_IN);
+    } else {
+      for (int j = 0; j < FAN_IN; j++) {
+        co_free(cos[j]);
+      }
+    }
+  }
+  report(batch ? "fan_out_batch" : "fan_out_single", FAN_IN, NULL);
+}
+
+static void *identity(void *arg) {
+  return arg;
+}
+
+// An operation is a co_run_blocking of a function that returns at once, from the call to the resumption of the caller:
+// the handoff to a thread of the pool and the wakeup of the scheduler through its eventfd.
+static void bench_blocking() {
+  last = now_ns();
+  for (int i = 0; i < SAMPLES / 10; i++) {
+    for (int j = 0; j < BATCH; j++) {
+      co_run_blocking(identity, NULL);
+    }
+    sample(BATCH);
+  }
+  struct co_blocking_pool_stats stats;
+  co_blocking_pool_get_stats(&stats);
+  char extra[64];
+  snprintf(extra, sizeof(extra), ", \"queue_wait_mean\": %.1f", (double) stats.wait_ns_total / stats.completed);
+  report("blocking_round_trip", BATCH, extra);
+}
+
+static co_scheduler_t *post_sched;
+static coroutine_t *post_waiter;
+static long post_runs;
+
+static void posted(void *arg) {
+  if (++post_runs % BATCH == 0) {
+    sample(BATCH);
+  }
+  if (post_runs == (long) SAMPLES * BATCH) {
+    co_unpark(post_waiter);
+  }
+}
+
+static void *poster(void *arg) {
+  for (long i = 0; i < (long) SAMPLES * BATCH; i++) {
+    co_post(post_sched, "posted", posted, NULL);
+  }
+  return NULL;
+}
+
+static void park_until_posted(void *arg) {
+  while (post_runs < (long) SAMPLES * BATCH) {
+    co_park();
+  }
+}
+
+// A thread posts coroutines that return at once to this scheduler: an operation is a message through the inbox and the
+// run of the coroutine it spawns.
+static void bench_post() {
+  post_sched = co_scheduler_self();
+  post_waiter = co_start("waiter", park_until_posted, NULL);
+  co_yield(); // parked before the first post
+  pthread_t thread;
+  double start = now_ns();
+  last = start;
+  pthread_create(&thread, NULL, poster, NULL);
+  co_wait(post_waiter);
+  double elapsed = now_ns() - start;
+  pthread_join(thread, NULL);
+  co_free(post_waiter);
+  char extra[64];
+  snprintf(extra, sizeof(extra), ", \"messages_per_sec\": %.0f", (double) SAMPLES * BATCH / elapsed * 1e9);
+  report("cross_thread_post", BATCH, extra);
+}
+
+// Parked coroutines with shared stacks: a dedicated stack takes two mappings, which vm.max_map_count bounds to about
+// 32K coroutines.
+static void bench_rss(int n) {
+  co_attr_t attr = {.stack_kind = CO_STACK_SHARED};
+  coroutine_t **cos = malloc(sizeof(coroutine_t *) * n);
+  long before = rss_kb();
+  for (int i = 0; i < n; i++) {
+    cos[i] = co_start_ex("yield_once", yield_once, NULL, &attr);
+  }
+  co_yield(); // every coroutine runs once and parks
+  long parked = rss_kb();
+  for (int i = 0; i < n; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  free(cos);
+  printf(",\n    {\"name\": \"rss_per_coroutine\", \"unit\": \"bytes\", \"coroutines\": %d, \"value\": %.1f}",
+         n, (parked - before) * 1024.0 / n);
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  printf("{\n  \"benchmarks\": [\n");
+  bench_yield();
+  bench_resume();
+  bench_spawn();
+  bench_fan_in();
+  bench_fan_out(false);
+  bench_fan_out(true);
+  bench_chan();
+  bench_blocking();
+  bench_post();
+  bench_rss(n);
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,206 @@
+#undef NDEBUG
+
+#include "coroutine-internal.h"
+
+#define BLOCKING_POOL_THREADS 4
+#define BLOCKING_POOL_DEPTH 1024
+
+// A call of co_run_blocking, on the stack of the caller, which is parked until it completes.
+struct blocking_job {
+  struct inbox_node node; // pushed to the inbox of sched once fn returns
+  void *(*fn)(void *);
+  void *arg;
+  void *result;
+  struct co *co;
+  struct co_scheduler *sched; // NULL for runtime coroutines, which are parked until done is set
+  bool done;
+  uint64_t submit_ns;
+  struct blocking_job *next; // in the queue of the pool, or in the line of the calls waiting for room in it
+};
+
+// blocking_mutex protects the queue, the thread counts and the stats but the latency ones, which are updated by the
+// callers when they resume.
+static pthread_mutex_t blocking_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blocking_cond = PTHREAD_COND_INITIALIZER; // signaled when a job is queued
+static struct blocking_job *blocking_head;
+static struct blocking_job *blocking_tail;
+static struct blocking_job *blocking_full_head; // the calls that found the queue full, moved to it as room is made
+static struct blocking_job *blocking_full_tail;
+static size_t blocking_threads_max = BLOCKING_POOL_THREADS;
+static size_t blocking_depth = BLOCKING_POOL_DEPTH;
+static size_t blocking_idle;
+static struct co_blocking_pool_stats blocking_stats;
+
+static void blocking_done_(struct co_scheduler *s, struct inbox_node *node) {
+  struct blocking_job *job = (struct blocking_job *) node;
+  s->reactor.waiters--;
+  co_unblock_(s, job->co);
+}
+
+static void *blocking_worker_(void *arg);
+
+// Called with blocking_mutex held.
+static void blocking_spawn_() {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, blocking_worker_, NULL);
+  pthread_attr_destroy(&attr);
+  if (err == 0) {
+    blocking_stats.threads++;
+  } else if (blocking_stats.threads == 0) {
+    panic("pthread_create for the blocking pool fails: %s\n", strerror(err));
+  }
+}
+
+// Called with blocking_mutex held. A thread is started for job if none is idle and the pool is not at its size yet.
+static void blocking_enqueue_(struct blocking_job *job) {
+  job->next = NULL;
+  if (blocking_tail != NULL) {
+    blocking_tail->next = job;
+  } else {
+    blocking_head = job;
+  }
+  blocking_tail = job;
+  blocking_stats.queued++;
+  if (blocking_idle > 0) {
+    pthread_cond_signal(&blocking_cond);
+  } else if (blocking_stats.threads < blocking_threads_max) {
+    blocking_spawn_();
+  }
+}
+
+// Called with blocking_mutex held, when the queue may have room again. The calls waiting for it move in, in order,
+// while their callers stay parked until they complete: nothing wakes them up before.
+static void blocking_admit_() {
+  while (blocking_full_head != NULL && blocking_stats.queued < blocking_depth) {
+    struct blocking_job *job = blocking_full_head;
+    blocking_full_head = job->next;
+    if (blocking_full_head == NULL) {
+      blocking_full_tail = NULL;
+    }
+    blocking_enqueue_(job);
+  }
+}
+
+static void *blocking_worker_(void *arg) {
+  pthread_mutex_lock(&blocking_mutex);
+  for (;;) {
+    while (blocking_head == NULL && blocking_stats.threads <= blocking_threads_max) {
+      blocking_idle++;
+      pthread_cond_wait(&blocking_cond, &blocking_mutex);
+      blocking_idle--;
+    }
+    if (blocking_stats.threads > blocking_threads_max) {
+      break; // the pool was shrunk
+    }
+    struct blocking_job *job = blocking_head;
+    blocking_head = job->next;
+    if (blocking_head == NULL) {
+      blocking_tail = NULL;
+    }
+    blocking_stats.queued--;
+    blocking_admit_();
+    blocking_stats.running++;
+    uint64_t wait = clock_ns_() - job->submit_ns;
+    blocking_stats.wait_ns_total += wait;
+    blocking_stats.wait_ns_max = wait > blocking_stats.wait_ns_max ? wait : blocking_stats.wait_ns_max;
+    pthread_mutex_unlock(&blocking_mutex);
+    job->result = job->fn(job->arg);
+    pthread_mutex_lock(&blocking_mutex);
+    blocking_stats.running--;
+    blocking_stats.completed++;
+    pthread_mutex_unlock(&blocking_mutex);
+    // the caller may resume and return as soon as the job is handed back
+    if (job->sched != NULL) {
+      inbox_push_(job->sched, &job->node);
+    } else {
+      runtime_unpark_(job->co, &job->done);
+    }
+    pthread_mutex_lock(&blocking_mutex);
+  }
+  blocking_stats.threads--;
+  pthread_mutex_unlock(&blocking_mutex);
+  return NULL;
+}
+
+// Queues job, or puts it in line for room in the queue if the queue holds blocking_depth jobs already, or other calls
+// wait for room before it.
+static void blocking_submit_(struct blocking_job *job) {
+  pthread_mutex_lock(&blocking_mutex);
+  job->submit_ns = clock_ns_();
+  blocking_stats.submitted++;
+  if (blocking_full_head != NULL || blocking_stats.queued >= blocking_depth) {
+    blocking_stats.full_waits++;
+    job->next = NULL;
+    if (blocking_full_tail != NULL) {
+      blocking_full_tail->next = job;
+    } else {
+      blocking_full_head = job;
+    }
+    blocking_full_tail = job;
+  } else {
+    blocking_enqueue_(job);
+  }
+  pthread_mutex_unlock(&blocking_mutex);
+}
+
+void *co_run_blocking(void *(*fn)(void *), void *arg) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  // The thread writes the result while the caller is parked, when a shared stack may hold the frames of another
+  // coroutine.
+  struct blocking_job on_stack;
+  struct blocking_job *job = current->stack_kind == CO_STACK_SHARED ? malloc(sizeof(struct blocking_job)) : &on_stack;
+  if (job == NULL) {
+    panic("malloc for blocking_job fails");
+  }
+  job->node.handler = blocking_done_;
+  job->fn = fn;
+  job->arg = arg;
+  job->co = current;
+  job->sched = current->runtime ? NULL : s;
+  job->done = false;
+  if (job->sched != NULL) {
+    inbox_setup_(s);
+  }
+  blocking_submit_(job);
+  if (job->sched != NULL) {
+    s->reactor.waiters++;
+    co_block_(s);
+  } else {
+    runtime_park_(current, &job->done, 0);
+  }
+  uint64_t latency = clock_ns_() - job->submit_ns;
+  __atomic_add_fetch(&blocking_stats.latency_ns_total, latency, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&blocking_stats.latency_ns_max, __ATOMIC_RELAXED);
+  while (latency > max && !__atomic_compare_exchange_n(&blocking_stats.latency_ns_max, &max, latency, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  void *result = job->result;
+  if (job != &on_stack) {
+    free(job);
+  }
+  return result;
+}
+
+void co_blocking_pool_config(size_t threads, size_t depth) {
+  if (threads == 0 || depth == 0) {
+    panic("the blocking pool needs a thread and room for a call");
+  }
+  pthread_mutex_lock(&blocking_mutex);
+  blocking_threads_max = threads;
+  blocking_depth = depth;
+  blocking_admit_();
+  pthread_cond_broadcast(&blocking_cond); // the idle threads above the size exit
+  pthread_mutex_unlock(&blocking_mutex);
+}
+
+void co_blocking_pool_get_stats(struct co_blocking_pool_stats *stats) {
+  pthread_mutex_lock(&blocking_mutex);
+  *stats = blocking_stats;
+  pthread_mutex_unlock(&blocking_mutex);
+  stats->latency_ns_total = __atomic_load_n(&blocking_stats.latency_ns_total, __ATOMIC_RELAXED);
+  stats->latency_ns_max = __atomic_load_n(&blocking_stats.latency_ns_max, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,232 @@
+#undef NDEBUG
+
+#include "coroutine-internal.h"
+
+// A bounded ring buffer of cap elements, with the coroutines parked to send and to receive. Elements are handed over
+// directly between the coroutines whenever possible: a sender fills the buffers of the parked receivers when the ring
+// is empty, and a receiver takes from the parked senders when the ring is empty, then refills the ring from them. So a
+// parked coroutine is only woken up once it is done, and an unbuffered channel (cap 0) is a rendezvous.
+struct co_chan {
+  struct co_scheduler *sched;
+  size_t elem_size;
+  size_t cap;
+  size_t head;
+  size_t len;
+  bool closed;
+  struct list_head senders;   // chan_waiter, oldest first
+  struct list_head receivers;
+  uint8_t buf[];
+};
+
+struct co_chan *co_chan_new(size_t elem_size, size_t cap) {
+  struct co_chan *ch = malloc(sizeof(struct co_chan) + elem_size * cap);
+  if (ch == NULL) {
+    panic("malloc for co_chan fails");
+  }
+  ch->sched = sched_();
+  ch->elem_size = elem_size;
+  ch->cap = cap;
+  ch->head = 0;
+  ch->len = 0;
+  ch->closed = false;
+  list_head_init_(&ch->senders);
+  list_head_init_(&ch->receivers);
+  return ch;
+}
+
+void co_chan_free(struct co_chan *ch) {
+  assert(list_head_empty_(&ch->senders) && list_head_empty_(&ch->receivers));
+  free(ch);
+}
+
+struct co_scheduler *chan_sched_(struct co_chan *ch) {
+  struct co_scheduler *s = sched_();
+  if (s != ch->sched || s->current->runtime) {
+    panic("a channel is only for the coroutines of the scheduler that created it");
+  }
+  return s;
+}
+
+static struct chan_waiter *chan_waiter_get_(struct co_scheduler *s) {
+  struct chan_waiter *w = s->chan_waiters;
+  if (w != NULL) {
+    s->chan_waiters = w->next;
+    return w;
+  }
+  w = malloc(sizeof(struct chan_waiter));
+  if (w == NULL) {
+    panic("malloc for chan_waiter fails");
+  }
+  stats_inc_(s, heap_allocs);
+  return w;
+}
+
+void chan_waiter_put_(struct co_scheduler *s, struct chan_waiter *w) {
+  w->next = s->chan_waiters;
+  s->chan_waiters = w;
+}
+
+void chan_waiter_pool_destroy_(struct co_scheduler *s) {
+  while (s->chan_waiters != NULL) {
+    struct chan_waiter *w = s->chan_waiters;
+    s->chan_waiters = w->next;
+    free(w);
+  }
+}
+
+// Copies n elements at the tail of the ring, which has room for them.
+static void chan_put_(struct co_chan *ch, const uint8_t *src, size_t n) {
+  while (n > 0) {
+    size_t tail = (ch->head + ch->len) % ch->cap;
+    size_t k = ch->cap - tail < n ? ch->cap - tail : n;
+    memcpy(ch->buf + tail * ch->elem_size, src, k * ch->elem_size);
+    ch->len += k;
+    src += k * ch->elem_size;
+    n -= k;
+  }
+}
+
+// Copies n elements out of the head of the ring, which has them.
+static void chan_get_(struct co_chan *ch, uint8_t *dst, size_t n) {
+  while (n > 0) {
+    size_t k = ch->cap - ch->head < n ? ch->cap - ch->head : n;
+    memcpy(dst, ch->buf + ch->head * ch->elem_size, k * ch->elem_size);
+    ch->head = (ch->head + k) % ch->cap;
+    ch->len -= k;
+    dst += k * ch->elem_size;
+    n -= k;
+  }
+}
+
+// Unlinks w, whose operation is over, and wakes its coroutine up.
+static void chan_waiter_wake_(struct co_scheduler *s, struct chan_waiter *w) {
+  list_head_del_(&w->link);
+  list_head_init_(&w->link);
+  if (w->index >= 0) {
+    select_fire_(s, w->co, w->index);
+  } else {
+    co_unblock_(s, w->co);
+  }
+}
+
+// Sends as many of the n elements at src as possible without waiting.
+static size_t chan_send_some_(struct co_scheduler *s, struct co_chan *ch, const uint8_t *src, size_t n) {
+  size_t size = ch->elem_size;
+  size_t done = 0;
+  // Parked receivers mean that the ring is empty.
+  while (done < n && !list_head_empty_(&ch->receivers)) {
+    struct chan_waiter *w = list_entry_(ch->receivers.next, struct chan_waiter, link);
+    size_t k = w->n - w->done < n - done ? w->n - w->done : n - done;
+    memcpy((uint8_t *) co_addr_(w->co, w->buf) + w->done * size, src + done * size, k * size);
+    w->done += k;
+    done += k;
+    chan_waiter_wake_(s, w);
+  }
+  size_t k = ch->cap - ch->len < n - done ? ch->cap - ch->len : n - done;
+  chan_put_(ch, src + done * size, k);
+  return done + k;
+}
+
+// Receives up to n elements into dst without waiting.
+static size_t chan_recv_some_(struct co_scheduler *s, struct co_chan *ch, uint8_t *dst, size_t n) {
+  size_t size = ch->elem_size;
+  size_t done = ch->len < n ? ch->len : n;
+  chan_get_(ch, dst, done);
+  // Parked senders mean that the ring is full, or just emptied by us. Their elements come after those in the ring.
+  while (!list_head_empty_(&ch->senders) && (done < n || ch->len < ch->cap)) {
+    struct chan_waiter *w = list_entry_(ch->senders.next, struct chan_waiter, link);
+    const uint8_t *src = (uint8_t *) co_addr_(w->co, w->buf) + w->done * size;
+    size_t k;
+    if (ch->len == 0 && done < n) {
+      k = w->n - w->done < n - done ? w->n - w->done : n - done;
+      memcpy(dst + done * size, src, k * size);
+      done += k;
+    } else {
+      k = w->n - w->done < ch->cap - ch->len ? w->n - w->done : ch->cap - ch->len;
+      chan_put_(ch, src, k);
+    }
+    w->done += k;
+    if (w->done == w->n) {
+      chan_waiter_wake_(s, w);
+    }
+  }
+  return done;
+}
+
+struct chan_waiter *chan_enqueue_(struct co_scheduler *s, struct co_chan *ch, bool send, void *buf, size_t n,
+                                  size_t done, int index) {
+  struct chan_waiter *w = chan_waiter_get_(s);
+  w->co = s->current;
+  w->buf = buf;
+  w->n = n;
+  w->done = done;
+  w->index = index;
+  w->next = NULL;
+  list_head_add_tail_(send ? &ch->senders : &ch->receivers, &w->link);
+  return w;
+}
+
+// Parks the current coroutine in the queue of ch until its operation is over, returns how many elements it moved.
+static size_t chan_park_(struct co_scheduler *s, struct co_chan *ch, bool send, void *buf, size_t n, size_t done) {
+  struct chan_waiter *w = chan_enqueue_(s, ch, send, buf, n, done, -1);
+  co_block_(s);
+  done = w->done;
+  chan_waiter_put_(s, w);
+  return done;
+}
+
+bool chan_try_(struct co_scheduler *s, struct co_chan *ch, bool send, void *elem, int *ok) {
+  if (send ? !ch->closed && chan_send_some_(s, ch, elem, 1) == 1 : chan_recv_some_(s, ch, elem, 1) == 1) {
+    *ok = 0;
+    return true;
+  }
+  if (ch->closed) {
+    *ok = -1;
+    return true;
+  }
+  return false;
+}
+
+size_t co_chan_send_n(struct co_chan *ch, const void *elems, size_t n) {
+  struct co_scheduler *s = chan_sched_(ch);
+  if (ch->closed) {
+    return 0;
+  }
+  size_t done = chan_send_some_(s, ch, elems, n);
+  if (done == n) {
+    preempt_check_(s); // a producer that never fills the buffer would not switch otherwise
+    return n;
+  }
+  // The receivers take the rest from us, we are woken up once they are done or the channel is closed.
+  return chan_park_(s, ch, true, (void *) elems, n, done);
+}
+
+size_t co_chan_recv_n(struct co_chan *ch, void *elems, size_t n) {
+  struct co_scheduler *s = chan_sched_(ch);
+  size_t done = chan_recv_some_(s, ch, elems, n);
+  if (done > 0 || n == 0 || ch->closed) {
+    preempt_check_(s);
+    return done;
+  }
+  // We are woken up once a sender gave us something or the channel is closed.
+  return chan_park_(s, ch, false, elems, n, 0);
+}
+
+int co_chan_send(struct co_chan *ch, const void *elem) {
+  return co_chan_send_n(ch, elem, 1) == 1 ? 0 : -1;
+}
+
+int co_chan_recv(struct co_chan *ch, void *elem) {
+  return co_chan_recv_n(ch, elem, 1) == 1 ? 0 : -1;
+}
+
+void co_chan_close(struct co_chan *ch) {
+  struct co_scheduler *s = chan_sched_(ch);
+  ch->closed = true;
+  while (!list_head_empty_(&ch->receivers)) {
+    chan_waiter_wake_(s, list_entry_(ch->receivers.next, struct chan_waiter, link));
+  }
+  while (!list_head_empty_(&ch->senders)) {
+    chan_waiter_wake_(s, list_entry_(ch->senders.next, struct chan_waiter, link));
+  }
+}
@@ -0,0 +1,803 @@
+#ifndef COROUTINE_IN_C_COROUTINE_INTERNAL_H
+#define COROUTINE_IN_C_COROUTINE_INTERNAL_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+#define panic(fmt, ...) do { \
+    fprintf(stderr, "\033[31mPANIC\033[0m at %s:%d in %s: " fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
+    exit(1); \
+} while (0)
+
+#define COROUTINE_STACK_SIZE (32 * 1024) // 32KB
+// The scheduler may poll on it, and the first call to a function through the PLT saves the whole vector register state
+// while binding it, several KB with AVX-512.
+#define RUNTIME_STACK_SIZE (16 * 1024)   // 16KB
+#define SHARED_STACK_SIZE (256 * 1024)   // 256KB
+#define SHARED_STACK_NUM 4
+#define STACK_POOL_DEFAULT_CAP 64
+#define CO_PRIORITY_NUM 3
+#define RUN_RING_INIT_CAP 64
+#define STARVATION_LIMIT 32 // picks of more urgent levels in a row while a level has coroutines
+#define STACK_ADAPTIVE_PROBE_SIZE (256 * 1024) // 256KB, for the first run of a class
+#define STACK_ADAPTIVE_MIN_SIZE (8 * 1024)      // 8KB
+#define STACK_POOL_CLASS_NUM 6                  // 8KB to 256KB
+#define STACK_ADAPTIVE_RESAMPLE 64              // one coroutine of a learned class in 64 is measured again
+#define STACK_PAINT_BYTE 0xa5
+#define STACK_PAINT_WORD ((uintptr_t) 0xa5a5a5a5a5a5a5a5ull)
+#define CACHE_LINE_SIZE 64
+#define CO_SLAB_SIZE (64 * 1024) // 64KB, also the alignment of a slab
+#define CO_INLINE_NAME_SIZE 32
+#define CO_STACK_DEFAULT_KIND CO_STACK_MMAP
+#define CO_STACK_KIND_NUM 2
+#define POLL_INTERVAL 61 // schedules between two nonblocking polls of the reactor and the timers
+#define TIMER_TICK_NS 1000000 // 1ms, the resolution of the timers
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_NUM 6
+#define PREEMPT_SIGNAL SIGURG // ignored by default and seldom used, the other ones go to the previous handler
+#define TRACE_NAME_SIZE 15
+
+#ifdef COROUTINE_USE_SETJMP
+struct co_context {
+  jmp_buf buf;
+  void *sp;    // stack top of a context that has not started yet, then the lowest live address of a saved context
+  void *entry; // NULL once the context has started
+  void *arg;
+};
+#else
+struct co_context {
+  void *sp; // callee-saved registers and the return address are saved on the stack itself
+};
+#endif
+
+enum co_status {
+  CO_NEW,
+  CO_RUNNING,
+  CO_WAITING,
+  CO_DEAD
+};
+
+struct shared_stack;
+struct co_scheduler;
+struct select_state;
+
+// Intrusive doubly linked list, the nodes are embedded in struct co so that moving a coroutine between lists never
+// allocates.
+struct list_head {
+  struct list_head *next;
+  struct list_head *prev;
+};
+
+// Work handed to a scheduler by other threads: a completion of co_run_blocking, a co_post or a co_unpark. handler runs
+// on the thread of the scheduler, and may unblock coroutines.
+struct inbox_node {
+  struct inbox_node *next;
+  void (*handler)(struct co_scheduler *s, struct inbox_node *node);
+};
+
+#define list_entry_(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+struct co {
+  char *name; // points to inline_name unless the name is too long
+  void (*func)(void *);
+  void *arg;
+  struct co_scheduler *sched; // the scheduler running it, which changes for runtime coroutines
+  enum co_status status;
+  int lock;      // runtime coroutines only, protects status and waiters across workers
+  bool runtime;  // started into the work-stealing runtime
+  bool released; // runtime coroutines only, set once the worker it died on no longer touches it
+  int park_state; // runtime coroutines only, see runtime_park_
+  bool woken;     // runtime coroutines only, set when the poller or a dying coroutine unparks it, maybe too late
+  struct co_context context;
+  uint8_t *stack; // lowest usable address
+  size_t stack_size;
+  enum co_stack_kind stack_kind;
+  bool stack_painted; // filled with STACK_PAINT_BYTE when allocated, for stack_scan_
+  size_t stack_peak;  // the high water found when it died
+  struct stack_batch *stack_batch; // the mapping its stack was carved from by co_start_batch, NULL otherwise
+  struct shared_stack *shared_stack; // CO_STACK_SHARED only
+  uint8_t *save_buf;                 // the live part of the shared stack while another coroutine runs on it
+  size_t save_size;
+  size_t save_cap;
+  struct list_head link;      // the position in waiting_list/dead_list
+  uint32_t ready_pos;         // the position in the run ring of its level while queued
+  uint8_t level;              // of the run queue, 0 is the most urgent
+  bool queued;
+  struct list_head waiters;   // coroutines waiting for this one to die, linked by their wait_link
+  struct list_head wait_link; // self-linked when not on a list of waiters
+  struct list_head timer_link; // in a slot of the timing wheel while a timer is armed, self-linked otherwise
+  uint64_t timer_expire;       // in ticks of the timing wheel
+  bool timed_out;
+  int io_result; // of the io_uring operation it is parked on
+  struct select_state *select; // on its own stack while it waits in co_select
+  struct co *caller;           // the coroutine parked in co_gen_next until this one yields a value or dies
+  void *value;                 // the last value passed to co_yield_value
+  bool transfer_parked;        // CO_WAITING in co_transfer, co_gen_next or co_yield_value until switched back to
+  bool detached;               // started by co_post, released by the library since nobody can co_free it
+  bool parked;                 // CO_WAITING in co_park
+  bool permit;                 // co_unpark was called while it was not parked, the next co_park returns at once
+  int wake_posted;             // wake_node is in the inbox of sched
+  bool release_on_wake;        // released while wake_node was in the inbox, wake_handler_ releases it
+  struct inbox_node wake_node; // pushed by co_unpark from other threads
+#ifdef COROUTINE_STATS
+  struct co_stats stats;
+  uint64_t stats_at;  // the cycle it was switched in while it runs, switched out otherwise
+  bool stats_parked;  // switched out parked
+#endif
+#ifdef COROUTINE_TRACE
+  uint32_t trace_id;
+#endif
+  char inline_name[CO_INLINE_NAME_SIZE];
+};
+
+struct list {
+  int len;
+  struct list_head head;
+};
+
+static inline void list_head_init_(struct list_head *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static inline bool list_head_empty_(const struct list_head *head) {
+  return head->next == head;
+}
+
+static inline void list_head_add_tail_(struct list_head *head, struct list_head *node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static inline void list_head_del_(struct list_head *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+}
+
+static inline void list_init_(struct list *list) {
+  list->len = 0;
+  list_head_init_(&list->head);
+}
+
+static inline void list_push_back_(struct list *list, struct co *co) {
+  list->len++;
+  list_head_add_tail_(&list->head, &co->link);
+}
+
+static inline void list_erase_(struct list *list, struct co *co) {
+  list->len--;
+  list_head_del_(&co->link);
+}
+
+static inline void list_move_back_(struct list *from, struct list *to, struct co *co) {
+  list_erase_(from, co);
+  list_push_back_(to, co);
+}
+
+static inline void list_head_splice_init_(struct list_head *from, struct list_head *to) {
+  if (list_head_empty_(from)) {
+    list_head_init_(to);
+    return;
+  }
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  list_head_init_(from);
+}
+
+static inline struct co *list_front_(struct list *list) {
+  assert(list->len > 0);
+  return list_entry_(list->head.next, struct co, link);
+}
+
+// The ready coroutines of one priority level, oldest first, in a ring that doubles when full. Positions are free
+// running counters, so that a coroutine removed by a directed switch finds its slot from ready_pos. It leaves a NULL
+// behind unless it was at either end, which is skipped when it reaches the front and dropped when the ring grows.
+struct run_ring {
+  struct co **slots; // NULL until the first push
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail;
+  int len; // coroutines, the NULL slots excluded
+};
+
+struct run_queue {
+  struct run_ring levels[CO_PRIORITY_NUM];
+  unsigned int mask; // a bit per level with coroutines
+  int skipped[CO_PRIORITY_NUM]; // picks of more urgent levels in a row while the level had coroutines
+  int len;
+};
+
+// Free coroutine stacks kept for reuse, one list per stack kind and power-of-2 size, the sizes stack_class_size_ hands
+// out. A free stack stores the pointer to the next one in its topmost bytes, which are the ones already committed.
+struct stack_pool {
+  uint8_t *head[CO_STACK_KIND_NUM][STACK_POOL_CLASS_NUM];
+  size_t size;
+  size_t cap;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+// A mapping holding the stacks of several coroutines started by co_start_batch, unmapped at once when the last of them
+// dies.
+struct stack_batch {
+  uint8_t *map;
+  size_t size;
+  size_t live;
+};
+
+// The peak stack use learned for the coroutines started with func, in an open-addressing table of the scheduler.
+struct stack_class {
+  void (*func)(void *); // NULL for an empty slot
+  size_t peak;
+  unsigned long samples; // coroutines of the class measured when they died
+  unsigned long spawns;  // coroutines sized from peak, to pick the ones to measure again
+  bool probing;          // one runs on a probe stack before any sample exists
+};
+
+// Stacks shared by CO_STACK_SHARED coroutines. Only the owner's frames are on the stack, the frames of the other
+// coroutines assigned to it are saved in their save_buf and copied back when they are scheduled.
+struct shared_stack {
+  uint8_t *stack;
+  struct co *owner;
+};
+
+// Control blocks are carved out of CO_SLAB_SIZE-aligned slabs in cache-line-sized slots, so that a slot finds its slab
+// by masking its address. Slabs with free slots are kept in co_arena.partial, empty ones are only given back by
+// co_arena_release.
+struct co_slab {
+  struct list_head link; // in co_arena.partial while it has free slots
+  void *free_slots;      // linked through the first word of each free slot
+  int used;
+};
+
+#define CO_SLOT_SIZE ((sizeof(struct co) + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1))
+#define CO_SLAB_HEADER_SIZE ((sizeof(struct co_slab) + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1))
+#define CO_SLOTS_PER_SLAB ((CO_SLAB_SIZE - CO_SLAB_HEADER_SIZE) / CO_SLOT_SIZE)
+
+struct co_arena {
+  struct list_head partial;
+  int slabs;
+};
+
+struct worker;
+
+#ifdef COROUTINE_TRACE
+// Why the running coroutine was switched out, or TRACE_START for the event that names a coroutine.
+enum trace_type {
+  TRACE_START,
+  TRACE_YIELD,
+  TRACE_WAIT,     // co_wait
+  TRACE_BLOCK,    // I/O, timers, channels, co_select and the synchronization primitives
+  TRACE_RESUME,
+  TRACE_TRANSFER, // co_transfer and generators
+  TRACE_EXIT,
+  TRACE_PREEMPT   // the time slice expired
+};
+
+struct trace_event {
+  uint64_t ts; // ns
+  uint32_t from;
+  uint32_t to;
+  uint8_t type;
+  char name[TRACE_NAME_SIZE]; // TRACE_START only, truncated and not always terminated
+};
+
+// Recorded by the thread of the scheduler only, the oldest events are overwritten once it is full.
+struct trace_ring {
+  struct trace_event *events; // NULL while tracing is off
+  size_t mask;
+  uint64_t head; // events ever recorded
+};
+#endif
+
+// The counters of co_scheduler_stats. The window ones are reset by every call.
+struct scheduler_stats {
+  uint64_t switches;
+  unsigned long started;
+  unsigned long heap_allocs;
+  unsigned long preemptions;
+  uint64_t base_ns; // when the scheduler was created
+  uint64_t base_cycles;
+  uint64_t window_ns;
+  uint64_t window_switches;
+  uint64_t ready_len_sum;
+  uint64_t waiting_len_sum;
+  int ready_len_max;
+  int waiting_len_max;
+};
+
+// A coroutine parked in the queue of a channel. Unlike wait_link, a coroutine can have one in several queues, as
+// co_select does. They are recycled through chan_waiters of the scheduler.
+struct chan_waiter {
+  struct list_head link; // in senders or receivers of the channel, self-linked once the operation is over
+  struct co *co;
+  uint8_t *buf; // on the stack of co, see co_addr_
+  size_t n;
+  size_t done;
+  int index;                // the case of co_select, -1 for the channel functions
+  struct chan_waiter *next; // the other waiters of the same co_select, or the next free one
+};
+
+// The coroutines parked on a file descriptor by the I/O functions. Descriptors are registered edge-triggered for both
+// directions on first use and stay registered until co_close, so an edge that comes while nobody waits is remembered
+// in readable/writable.
+struct fd_state {
+  struct co *reader;
+  struct co *writer;
+  int reader_index; // the case of co_select the reader waits in, -1 for the I/O functions
+  int writer_index;
+  bool registered;
+  bool file; // refused by epoll: always ready, read and written through io_uring when possible
+  bool readable;
+  bool writable;
+};
+
+struct reactor {
+  int epfd; // -1 until the first coroutine parks on a descriptor
+  struct fd_state *fds; // indexed by descriptor
+  int fd_cap;
+  int waiters; // coroutines parked on a descriptor, an io_uring operation or a call of co_run_blocking
+};
+
+// A lock-free MPSC queue: the other threads push nodes on a stack with a CAS, and the scheduler takes the whole stack
+// with one exchange, then runs the nodes in the order they were pushed. The push that finds the stack empty writes
+// the eventfd, which is in the epoll instance of the reactor, so that a sleeping scheduler wakes up.
+struct inbox {
+  struct inbox_node *head;
+  int fd;      // eventfd, -1 until set up by the thread of the scheduler
+  int pushers; // threads between their push and the write to fd, waited for before the scheduler is destroyed
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// An io_uring instance for the descriptors epoll refuses, regular files mostly, set up when a coroutine first reads or
+// writes one. A coroutine queues an SQE and parks, the SQEs queued meanwhile are submitted in one io_uring_enter when
+// the scheduler polls, and the completions are reaped from the CQ ring without a syscall. The ring fd is in the epoll
+// instance of the reactor, so that the scheduler sleeps on both at once.
+struct uring {
+  int fd;        // -1 until set up
+  bool disabled; // by co_io_uring, or because io_uring_setup fails: the blocking syscalls are used instead
+  uint32_t features;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  uint32_t cq_entries;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map; // sq_map with IORING_FEAT_SINGLE_MMAP
+  size_t cq_map_size;
+  size_t sqes_size;
+  uint32_t pending;  // SQEs queued and not submitted yet
+  uint32_t inflight; // operations not reaped yet, also counted in reactor.waiters
+};
+
+// Hierarchical timing wheel of TIMER_LEVEL_NUM levels of TIMER_LEVEL_SIZE slots. A slot of level l holds the timers
+// expiring in a span of TIMER_LEVEL_SIZE^l ticks, which are moved down a level when the wheel reaches the span, so
+// arming and cancelling a timer is O(1). occupied has a bit per non-empty slot to skip the empty ones.
+struct timer_wheel {
+  uint64_t base; // the clock at tick 0
+  uint64_t now;  // the last tick processed
+  long count;
+  uint64_t occupied[TIMER_LEVEL_NUM];
+  struct list_head slots[TIMER_LEVEL_NUM][TIMER_LEVEL_SIZE];
+};
+
+// The time slices of co_preempt_start. A timer on the CPU time of the thread sends it PREEMPT_SIGNAL every half slice,
+// and the handler marks the slice of the running coroutine as expired if there was no switch since the previous signal.
+// The coroutine gives the thread up at its next safe point: co_preempt_point or a channel operation.
+struct preempt {
+  timer_t timer;
+  bool enabled;
+  volatile sig_atomic_t expired;
+  volatile unsigned long switches;
+  unsigned long switches_seen; // by the handler, at the previous signal
+};
+
+// All the state of the coroutines of one thread. It is created by the first call into the library from a thread and
+// destroyed when the thread exits.
+struct co_scheduler {
+  struct co *current;
+  struct co *main; // the coroutine running on the stack of the thread
+  // current, run_queue, waiting_list, dead_list, detached_list are exclusive. All coroutine must belong to one and only
+  // one of them.
+  struct run_queue run_queue; // status: CO_NEW/CO_RUNNING
+  struct list waiting_list;   // status: CO_WAITING
+  struct list dead_list;      // status: CO_DEAD
+  struct list detached_list;  // status: CO_DEAD, started by co_post and released by the next one
+  struct stack_pool stack_pool;
+  bool stack_paint;
+  bool stack_adaptive;
+  struct stack_class *stack_classes;
+  size_t stack_class_cap; // a power of 2
+  size_t stack_class_len;
+  struct shared_stack shared_stacks[SHARED_STACK_NUM];
+  int shared_stack_next;
+  struct co_context shared_switch_context;
+  struct co_arena co_arena;
+  struct reactor reactor;
+  struct uring uring;
+  struct inbox inbox;
+  struct timer_wheel timer_wheel;
+  struct preempt preempt;
+  unsigned int poll_tick;
+  struct chan_waiter *chan_waiters; // free ones
+  struct worker *worker;    // set on the threads of the work-stealing runtime
+  int runtime_action;       // what the worker does with the runtime coroutine that just switched back to it
+  struct co *runtime_target;
+#ifdef COROUTINE_STATS
+  struct scheduler_stats stats;
+#endif
+#ifdef COROUTINE_TRACE
+  struct trace_ring trace;
+  enum trace_type trace_reason; // set before every switch
+#endif
+  uint8_t runtime_stack[RUNTIME_STACK_SIZE] __attribute__((aligned(16)));
+  uint8_t shared_switch_stack[RUNTIME_STACK_SIZE] __attribute__((aligned(16)));
+};
+
+extern __thread struct co_scheduler *tls_scheduler __attribute__((tls_model("initial-exec"), visibility("hidden")));
+
+__attribute__((visibility("hidden"))) struct co_scheduler *scheduler_create_();
+
+static inline struct co_scheduler *sched_() {
+  struct co_scheduler *s = tls_scheduler;
+  if (__builtin_expect(s == NULL, 0)) {
+    s = scheduler_create_();
+  }
+  return s;
+}
+
+static inline void stack_switch_call_(void *sp, void *entry, void *arg) {
+  asm volatile (
+#if __x86_64__
+      "movq %0, %%rsp; movq %2, %%rdi; jmp *%1"
+      :
+      : "b"((uintptr_t) sp - 8), "d"(entry), "a"(arg)
+      : "memory"
+#else
+    "movl %0, %%esp; movl %2, 4(%0); jmp *%1"
+    :
+    : "b"((uintptr_t) sp - 8), "d"(entry), "a"(arg)
+    : "memory"
+#endif
+      );
+}
+
+#ifndef COROUTINE_USE_SETJMP
+// void context_swap_(void **from_sp, void *to_sp);
+// Pushes the callee-saved registers, stores the stack pointer to *from_sp, then pops the registers saved on to_sp and
+// returns into that context. Everything else is caller-saved, so nothing more has to be preserved.
+__attribute__((visibility("hidden"))) void context_swap_(void **from_sp, void *to_sp);
+// The first return address of a context made by context_make_. Calls entry(arg), which must never return.
+__attribute__((visibility("hidden"))) void context_entry_(void);
+
+static inline void context_make_(struct co_context *ctx, void *sp, void *entry, void *arg) {
+  void **top = (void **) ((uintptr_t) sp & ~(uintptr_t) 15);
+#if __x86_64__
+  // r15, r14, r13 = arg, r12 = entry, rbx, rbp, return address, so that rsp is 16-byte aligned at the call to entry
+  void **frame = top - 9;
+  memset(frame, 0, 9 * sizeof(void *));
+  frame[2] = arg;
+  frame[3] = entry;
+  frame[6] = (void *) context_entry_;
+#else
+  // edi = entry, esi = arg, ebx, ebp, return address, so that esp is 16-byte aligned at the call to entry
+  void **frame = top - 9;
+  memset(frame, 0, 9 * sizeof(void *));
+  frame[0] = entry;
+  frame[1] = arg;
+  frame[4] = (void *) context_entry_;
+#endif
+  ctx->sp = frame;
+}
+
+static inline void context_switch_(struct co_context *from, struct co_context *to) {
+  context_swap_(&from->sp, to->sp);
+}
+
+static inline uint8_t *context_sp_(struct co_context *ctx) {
+  return ctx->sp;
+}
+#else
+// The frame address of a callee is below everything its caller keeps on the stack.
+static __attribute__((noinline)) void *stack_pointer_() {
+  return __builtin_frame_address(0);
+}
+
+static inline void context_make_(struct co_context *ctx, void *sp, void *entry, void *arg) {
+  ctx->sp = sp;
+  ctx->entry = entry;
+  ctx->arg = arg;
+}
+
+static inline void context_switch_(struct co_context *from, struct co_context *to) {
+  from->sp = stack_pointer_();
+  if (setjmp(from->buf) == 0) {
+    if (to->entry != NULL) {
+      void *entry = to->entry;
+      to->entry = NULL;
+      stack_switch_call_(to->sp, entry, to->arg);
+    }
+    longjmp(to->buf, 1);
+  }
+}
+
+static inline uint8_t *context_sp_(struct co_context *ctx) {
+  return ctx->sp;
+}
+#endif
+
+#define HIDDEN __attribute__((visibility("hidden")))
+
+// The calls that libcoroutine-hook interposes on are made as system calls here, so that the library never calls back
+// into the hooks.
+static inline ssize_t sys_read_(int fd, void *buf, size_t count) {
+  return syscall(SYS_read, fd, buf, count);
+}
+
+static inline ssize_t sys_write_(int fd, const void *buf, size_t count) {
+  return syscall(SYS_write, fd, buf, count);
+}
+
+static inline ssize_t sys_recv_(int fd, void *buf, size_t len, int flags) {
+  return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+static inline ssize_t sys_send_(int fd, const void *buf, size_t len, int flags) {
+  return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+static inline int sys_accept4_(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+  return (int) syscall(SYS_accept4, fd, addr, addrlen, flags);
+}
+
+static inline int sys_connect_(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  return (int) syscall(SYS_connect, fd, addr, addrlen);
+}
+
+static inline int sys_poll_(struct pollfd *fds, nfds_t n, int timeout) {
+  struct timespec ts = {timeout / 1000, timeout % 1000 * 1000000L};
+  return (int) syscall(SYS_ppoll, fds, n, timeout >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static inline int sys_nanosleep_(const struct timespec *req, struct timespec *rem) {
+  return (int) syscall(SYS_nanosleep, req, rem);
+}
+
+static inline int sys_close_(int fd) {
+  return (int) syscall(SYS_close, fd);
+}
+
+// The coroutines ready to run, current included.
+static inline int ready_len_(struct co_scheduler *s) {
+  return s->run_queue.len + 1;
+}
+
+static inline uint64_t clock_ns_() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef COROUTINE_STATS
+#define stats_inc_(s, counter) ((s)->stats.counter++)
+
+static inline uint64_t stats_cycles_() {
+#if __x86_64__ || __i386__
+  return __builtin_ia32_rdtsc();
+#else
+  return clock_ns_();
+#endif
+}
+
+// Where the stack of co starts, NULL for the stack of the thread.
+static inline uint8_t *stats_stack_top_(struct co *co) {
+  if (co->stack_kind == CO_STACK_SHARED) {
+    return co->shared_stack->stack + SHARED_STACK_SIZE;
+  }
+  return co->stack != NULL ? co->stack + co->stack_size : NULL;
+}
+
+// Accounts the switch from prev, whose stack pointer is sp, to next.
+static inline void stats_switch_(struct co_scheduler *s, struct co *prev, struct co *next, bool parked, uint8_t *sp) {
+  uint64_t now = stats_cycles_();
+  struct scheduler_stats *stats = &s->stats;
+  stats->switches++;
+  int ready_len = ready_len_(s);
+  stats->ready_len_sum += ready_len;
+  stats->waiting_len_sum += s->waiting_list.len;
+  stats->ready_len_max = ready_len > stats->ready_len_max ? ready_len : stats->ready_len_max;
+  stats->waiting_len_max = s->waiting_list.len > stats->waiting_len_max ? s->waiting_list.len : stats->waiting_len_max;
+  prev->stats.run_cycles += now - prev->stats_at;
+  prev->stats_at = now;
+  prev->stats_parked = parked;
+  uint8_t *top = stats_stack_top_(prev);
+  size_t depth = top != NULL && sp < top && prev->status != CO_DEAD ? (size_t) (top - sp) : 0;
+  if (depth <= prev->stack_size && depth > prev->stats.stack_high_water) {
+    prev->stats.stack_high_water = depth;
+  }
+  next->stats.switches++;
+  if (next->stats_parked) {
+    next->stats.wait_cycles += now - next->stats_at;
+  } else {
+    next->stats.ready_cycles += now - next->stats_at;
+  }
+  next->stats_at = now;
+}
+#else
+#define stats_inc_(s, counter) ((void) 0)
+
+static inline void stats_switch_(struct co_scheduler *s, struct co *prev, struct co *next, bool parked, uint8_t *sp) {
+}
+#endif
+
+#ifdef COROUTINE_TRACE
+extern HIDDEN uint32_t trace_next_id;
+
+#define trace_reason_(s, type) ((s)->trace_reason = (type))
+
+static inline void trace_record_(struct co_scheduler *s, enum trace_type type, uint32_t from, uint32_t to,
+                                 const char *name) {
+  struct trace_ring *ring = &s->trace;
+  if (ring->events == NULL) {
+    return;
+  }
+  struct trace_event *e = &ring->events[ring->head & ring->mask];
+  e->ts = clock_ns_();
+  e->from = from;
+  e->to = to;
+  e->type = type;
+  if (name != NULL) {
+    strncpy(e->name, name, TRACE_NAME_SIZE);
+  }
+  ring->head++;
+}
+
+static inline void trace_start_(struct co_scheduler *s, struct co *co) {
+  trace_record_(s, TRACE_START, 0, co->trace_id, co->name);
+}
+
+static inline void trace_switch_(struct co_scheduler *s, struct co *prev, struct co *next) {
+  trace_record_(s, s->trace_reason, prev->trace_id, next->trace_id, NULL);
+}
+#else
+#define trace_reason_(s, type) ((void) 0)
+
+static inline void trace_start_(struct co_scheduler *s, struct co *co) {
+}
+
+static inline void trace_switch_(struct co_scheduler *s, struct co *prev, struct co *next) {
+}
+#endif
+
+HIDDEN uint8_t *stack_alloc_(struct stack_pool *stack_pool, enum co_stack_kind kind, size_t size);
+HIDDEN void stack_free_(struct stack_pool *stack_pool, uint8_t *stack, enum co_stack_kind kind, size_t size);
+HIDDEN void co_init_(struct co_scheduler *s, struct co *co, const char *name, void (*func)(void *), void *arg,
+                     const co_attr_t *attr);
+HIDDEN void co_wrapper_(struct co *co);
+HIDDEN void co_release_(struct co_scheduler *s, struct co *co);
+HIDDEN void co_block_(struct co_scheduler *s);
+HIDDEN void co_unblock_(struct co_scheduler *s, struct co *co);
+HIDDEN struct co *co_start_detached_(struct co_scheduler *s, const char *name, void (*func)(void *), void *arg);
+
+// reactor.c
+HIDDEN void reactor_init_(struct reactor *reactor);
+HIDDEN void reactor_poll_(struct co_scheduler *s, int timeout);
+HIDDEN void reactor_destroy_(struct reactor *reactor);
+HIDDEN void reactor_add_(struct co_scheduler *s, int fd);
+HIDDEN void reactor_select_add_(struct co_scheduler *s, int fd, bool write, int index);
+HIDDEN void reactor_select_del_(struct co_scheduler *s, struct co *co, int fd, bool write);
+HIDDEN int reactor_epfd_(struct reactor *reactor);
+
+// uring.c
+HIDDEN void uring_init_(struct uring *u);
+HIDDEN void uring_destroy_(struct uring *u);
+HIDDEN bool uring_rw_(struct co_scheduler *s, bool write, int fd, void *buf, size_t count, off_t offset, ssize_t *n);
+HIDDEN void uring_flush_(struct co_scheduler *s);
+
+// inbox.c
+HIDDEN void inbox_init_(struct inbox *inbox);
+HIDDEN void inbox_destroy_(struct inbox *inbox);
+HIDDEN void inbox_setup_(struct co_scheduler *s);
+HIDDEN void inbox_push_(struct co_scheduler *s, struct inbox_node *node);
+HIDDEN void inbox_drain_(struct co_scheduler *s);
+HIDDEN void co_wake_(struct co_scheduler *s, struct co *co);
+
+// chan.c
+HIDDEN struct co_scheduler *chan_sched_(struct co_chan *ch);
+HIDDEN bool chan_try_(struct co_scheduler *s, struct co_chan *ch, bool send, void *elem, int *ok);
+HIDDEN struct chan_waiter *chan_enqueue_(struct co_scheduler *s, struct co_chan *ch, bool send, void *buf, size_t n,
+                                         size_t done, int index);
+HIDDEN void chan_waiter_put_(struct co_scheduler *s, struct chan_waiter *w);
+HIDDEN void chan_waiter_pool_destroy_(struct co_scheduler *s);
+
+// select.c
+HIDDEN void select_fire_(struct co_scheduler *s, struct co *co, int index);
+
+// Where the data at p on the stack of the parked coroutine co currently is: the frames of a CO_STACK_SHARED coroutine
+// that does not own its shared stack are in its save_buf.
+static inline void *co_addr_(struct co *co, void *p) {
+  if (co->stack_kind == CO_STACK_SHARED && co->shared_stack->owner != co) {
+    uint8_t *bottom = co->shared_stack->stack + SHARED_STACK_SIZE - co->save_size;
+    if ((uint8_t *) p >= bottom && (uint8_t *) p < bottom + co->save_size) {
+      return co->save_buf + ((uint8_t *) p - bottom);
+    }
+  }
+  return p;
+}
+
+// preempt.c
+HIDDEN void preempt_destroy_(struct co_scheduler *s);
+
+// Called at every switch: the coroutine switched in starts a new time slice.
+static inline void preempt_switch_(struct co_scheduler *s) {
+  s->preempt.switches++;
+  s->preempt.expired = 0;
+}
+
+// A safe point inside the library.
+static inline void preempt_check_(struct co_scheduler *s) {
+  if (s->preempt.expired) {
+    co_preempt_point();
+  }
+}
+
+// timer.c
+HIDDEN void timer_wheel_init_(struct timer_wheel *w);
+HIDDEN void timer_add_(struct timer_wheel *w, struct co *co, uint64_t ns);
+HIDDEN void timer_cancel_(struct timer_wheel *w, struct co *co);
+HIDDEN int timer_wheel_advance_(struct co_scheduler *s, struct timer_wheel *w);
+
+// trace.c
+HIDDEN void trace_destroy_(struct co_scheduler *s);
+
+// runtime.c
+enum runtime_action {
+  RUNTIME_YIELD,
+  RUNTIME_WAIT,
+  RUNTIME_PARK,
+  RUNTIME_EXIT
+};
+
+extern HIDDEN bool runtime_running;
+
+HIDDEN struct co *runtime_spawn_(const char *name, void (*func)(void *), void *arg, const co_attr_t *attr);
+HIDDEN void runtime_switch_out_(struct co_scheduler *s, struct co *co, enum runtime_action action, struct co *target);
+HIDDEN void runtime_wait_(struct co_scheduler *s, struct co *current, struct co *co);
+HIDDEN void runtime_free_(struct co *co);
+HIDDEN bool runtime_wait_timeout_(struct co *current, struct co *co, uint64_t deadline);
+HIDDEN bool runtime_park_(struct co *co, bool *flag, uint64_t deadline);
+HIDDEN void runtime_unpark_(struct co *co, bool *flag);
+HIDDEN bool runtime_fd_arm_(struct co *co, int fd, bool write);
+HIDDEN void runtime_fd_disarm_(struct co *co, int fd, bool write);
+
+#endif //COROUTINE_IN_C_COROUTINE_INTERNAL_H
@@ -1,291 +1,1200 @@
 #undef NDEBUG
 
-#include <assert.h>
-#include <setjmp.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "coroutine.h"
-
-#ifdef NDEBUG
-#define debug(fmt, ...)
-#else
-#define debug(fmt, ...) fprintf(stderr, "\033[90m[debug] " fmt "\033[0m", ##__VA_ARGS__)
-#endif
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-#define panic(fmt, ...) do { \
-    fprintf(stderr, "\033[31mPANIC\033[0m at %s:%d in %s: " fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
-    exit(1); \
-} while (0)
+#include "coroutine-internal.h"
 
-#define COROUTINE_STACK_SIZE (32 * 1024) // 32KB
-#define RUNTIME_STACK_SIZE (4 * 1024)    // 4KB
+__thread struct co_scheduler *tls_scheduler;
 
-uint8_t runtime_stack[RUNTIME_STACK_SIZE];
+static size_t page_size;
 
-enum co_status {
-  CO_NEW,
-  CO_RUNNING,
-  CO_WAITING,
-  CO_DEAD
-};
+static size_t stack_round_size_(enum co_stack_kind kind, size_t size) {
+  size_t align = kind == CO_STACK_MMAP ? page_size : 16;
+  return (size + align - 1) & ~(align - 1);
+}
+
+// Returns the lowest usable address of a new stack of size bytes.
+static uint8_t *stack_map_(enum co_stack_kind kind, size_t size) {
+  switch (kind) {
+    case CO_STACK_MALLOC: {
+      uint8_t *stack = malloc(size);
+      if (stack == NULL) {
+        panic("malloc for stack fails");
+      }
+      return stack;
+    }
+    case CO_STACK_MMAP: {
+      // Only address space is reserved here. Pages are committed by the kernel when they are first touched, and the
+      // PROT_NONE page below the stack turns an overflow into a SIGSEGV instead of a silent corruption.
+      uint8_t *map = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+      if (map == MAP_FAILED) {
+        panic("mmap for stack fails");
+      }
+      if (mprotect(map, page_size, PROT_NONE) != 0) {
+        panic("mprotect for stack guard page fails");
+      }
+      return map + page_size;
+    }
+    case CO_STACK_SHARED:
+      break;
+  }
+  assert(false);
+}
+
+static void stack_unmap_(uint8_t *stack, enum co_stack_kind kind, size_t size) {
+  switch (kind) {
+    case CO_STACK_MALLOC:
+      free(stack);
+      break;
+    case CO_STACK_MMAP:
+      munmap(stack - page_size, size + page_size);
+      break;
+    case CO_STACK_SHARED:
+      assert(false);
+  }
+}
+
+static inline uint8_t **stack_pool_link_(uint8_t *stack, size_t size) {
+  return (uint8_t **) (stack + size) - 1;
+}
+
+// The list of the pool that holds the stacks of size, one per power of 2 from STACK_ADAPTIVE_MIN_SIZE to
+// STACK_ADAPTIVE_PROBE_SIZE, or -1 if they are not pooled.
+static inline int stack_pool_class_(size_t size) {
+  if (size < STACK_ADAPTIVE_MIN_SIZE || size > STACK_ADAPTIVE_PROBE_SIZE || (size & (size - 1)) != 0) {
+    return -1;
+  }
+  return __builtin_ctzl(size / STACK_ADAPTIVE_MIN_SIZE);
+}
+
+uint8_t *stack_alloc_(struct stack_pool *stack_pool, enum co_stack_kind kind, size_t size) {
+  int class = stack_pool_class_(size);
+  if (class >= 0) {
+    uint8_t *stack = stack_pool->head[kind][class];
+    if (stack != NULL) {
+      stack_pool->head[kind][class] = *stack_pool_link_(stack, size);
+      stack_pool->size--;
+      stack_pool->hits++;
+      return stack;
+    }
+    stack_pool->misses++;
+  }
+  return stack_map_(kind, size);
+}
+
+void stack_free_(struct stack_pool *stack_pool, uint8_t *stack, enum co_stack_kind kind, size_t size) {
+  int class = stack_pool_class_(size);
+  if (class < 0 || stack_pool->size >= stack_pool->cap) {
+    stack_unmap_(stack, kind, size);
+    return;
+  }
+  *stack_pool_link_(stack, size) = stack_pool->head[kind][class];
+  stack_pool->head[kind][class] = stack;
+  stack_pool->size++;
+}
+
+static void stack_pool_trim_(struct stack_pool *stack_pool, size_t size) {
+  for (int kind = 0; kind < CO_STACK_KIND_NUM; kind++) {
+    for (int class = STACK_POOL_CLASS_NUM - 1; class >= 0 && stack_pool->size > size; class--) {
+      size_t stack_size = (size_t) STACK_ADAPTIVE_MIN_SIZE << class;
+      while (stack_pool->head[kind][class] != NULL && stack_pool->size > size) {
+        uint8_t *stack = stack_pool->head[kind][class];
+        stack_pool->head[kind][class] = *stack_pool_link_(stack, stack_size);
+        stack_pool->size--;
+        stack_unmap_(stack, kind, stack_size);
+      }
+    }
+  }
+}
+
+static struct co_slab *co_slab_new_(struct co_arena *co_arena) {
+  struct co_slab *slab = aligned_alloc(CO_SLAB_SIZE, CO_SLAB_SIZE);
+  if (slab == NULL) {
+    panic("aligned_alloc for co_slab fails");
+  }
+  slab->used = 0;
+  slab->free_slots = NULL;
+  uint8_t *slots = (uint8_t *) slab + CO_SLAB_HEADER_SIZE;
+  for (size_t i = CO_SLOTS_PER_SLAB; i-- > 0;) {
+    *(void **) (slots + i * CO_SLOT_SIZE) = slab->free_slots;
+    slab->free_slots = slots + i * CO_SLOT_SIZE;
+  }
+  list_head_add_tail_(&co_arena->partial, &slab->link);
+  co_arena->slabs++;
+  return slab;
+}
+
+static struct co *co_alloc_(struct co_arena *co_arena) {
+  struct co_slab *slab = list_head_empty_(&co_arena->partial)
+                         ? co_slab_new_(co_arena)
+                         : list_entry_(co_arena->partial.next, struct co_slab, link);
+  struct co *co = slab->free_slots;
+  slab->free_slots = *(void **) co;
+  if (++slab->used == CO_SLOTS_PER_SLAB) {
+    list_head_del_(&slab->link);
+  }
+  return co;
+}
 
-struct list;
+static void co_dealloc_(struct co_arena *co_arena, struct co *co) {
+  struct co_slab *slab = (struct co_slab *) ((uintptr_t) co & ~(uintptr_t) (CO_SLAB_SIZE - 1));
+  if (slab->used-- == CO_SLOTS_PER_SLAB) {
+    list_head_add_tail_(&co_arena->partial, &slab->link);
+  }
+  *(void **) co = slab->free_slots;
+  slab->free_slots = co;
+}
 
-typedef struct list_node waiter_list_node;
+static void co_arena_trim_(struct co_arena *co_arena) {
+  struct list_head *node = co_arena->partial.next;
+  while (node != &co_arena->partial) {
+    struct co_slab *slab = list_entry_(node, struct co_slab, link);
+    node = node->next;
+    if (slab->used == 0) {
+      list_head_del_(&slab->link);
+      free(slab);
+      co_arena->slabs--;
+    }
+  }
+}
 
-struct co {
-  char *name;
-  void (*func)(void *);
-  void *arg;
-  enum co_status status;
-  jmp_buf context;
-  uint8_t *stack;
-  waiter_list_node *waiter_list_head;
-  struct list_node *prev; // the position in ready_list/waiting_list/dead_list
+// The level of the run queue of each priority, the most urgent first.
+static const uint8_t priority_levels_[CO_PRIORITY_NUM] = {
+    [CO_PRIORITY_HIGH] = 0,
+    [CO_PRIORITY_NORMAL] = 1,
+    [CO_PRIORITY_LOW] = 2,
 };
 
-struct co *current;
+static uint8_t priority_level_(enum co_priority priority) {
+  if ((unsigned int) priority >= CO_PRIORITY_NUM) {
+    panic("invalid priority %d\n", priority);
+  }
+  return priority_levels_[priority];
+}
+
+// Makes room for extra more coroutines, doubling the ring if it is at least half full with coroutines, and drops its
+// NULL slots.
+static void run_ring_grow_(struct run_ring *r, uint32_t extra) {
+  uint32_t cap = r->slots == NULL ? RUN_RING_INIT_CAP : r->mask + 1;
+  if ((uint32_t) r->len * 2 > cap) {
+    cap *= 2;
+  }
+  while (r->len + extra > cap) {
+    cap *= 2;
+  }
+  struct co **slots = malloc(cap * sizeof(struct co *));
+  if (slots == NULL) {
+    panic("malloc for the run queue fails");
+  }
+  uint32_t n = 0;
+  for (uint32_t i = r->head; i != r->tail; i++) {
+    struct co *co = r->slots[i & r->mask];
+    if (co != NULL) {
+      co->ready_pos = n;
+      slots[n++] = co;
+    }
+  }
+  free(r->slots);
+  r->slots = slots;
+  r->mask = cap - 1;
+  r->head = 0;
+  r->tail = n;
+}
+
+// Queues co behind the coroutines of its level, or in front of them when it keeps its place after a directed switch.
+static void run_queue_push_(struct run_queue *q, struct co *co, bool front) {
+  struct run_ring *r = &q->levels[co->level];
+  if (r->slots == NULL || r->tail - r->head == r->mask + 1) {
+    run_ring_grow_(r, 1);
+  }
+  co->ready_pos = front ? --r->head : r->tail++;
+  r->slots[co->ready_pos & r->mask] = co;
+  co->queued = true;
+  r->len++;
+  q->len++;
+  q->mask |= 1u << co->level;
+}
+
+// Queues the coroutines of a batch, which have the same level, in one go.
+static void run_queue_push_batch_(struct run_queue *q, struct co **cos, size_t n) {
+  uint8_t level = cos[0]->level;
+  struct run_ring *r = &q->levels[level];
+  if (r->slots == NULL || r->tail - r->head + n > r->mask + 1) {
+    run_ring_grow_(r, n);
+  }
+  for (size_t i = 0; i < n; i++) {
+    cos[i]->ready_pos = r->tail++;
+    r->slots[cos[i]->ready_pos & r->mask] = cos[i];
+    cos[i]->queued = true;
+  }
+  r->len += n;
+  q->len += n;
+  q->mask |= 1u << level;
+}
+
+static void run_ring_taken_(struct run_queue *q, struct run_ring *r, struct co *co) {
+  co->queued = false;
+  q->len--;
+  if (--r->len == 0) {
+    r->head = r->tail = 0;
+    q->mask &= ~(1u << co->level);
+  }
+}
+
+static void run_queue_remove_(struct run_queue *q, struct co *co) {
+  struct run_ring *r = &q->levels[co->level];
+  r->slots[co->ready_pos & r->mask] = NULL;
+  if (co->ready_pos == r->tail - 1) {
+    r->tail--;
+  } else if (co->ready_pos == r->head) {
+    r->head++;
+  }
+  run_ring_taken_(q, r, co);
+}
 
-struct list_node {
-  struct list_node *next;
+// The front of the most urgent level, unless a less urgent level with coroutines was passed over STARVATION_LIMIT
+// times in a row: the least urgent such level goes first then. Every pick counts against all the less urgent levels
+// it passes over, so that each level waits a bounded number of picks however many levels are busy above it.
+static struct co *run_queue_pop_(struct run_queue *q) {
+  int level = __builtin_ctz(q->mask);
+  for (int l = level + 1; l < CO_PRIORITY_NUM; l++) {
+    if (q->mask & (1u << l) && q->skipped[l] >= STARVATION_LIMIT) {
+      level = l;
+    }
+  }
+  for (int l = 0; l < CO_PRIORITY_NUM; l++) {
+    if (!(q->mask & (1u << l)) || l == level) {
+      q->skipped[l] = 0;
+    } else if (l > level) {
+      q->skipped[l]++;
+    }
+  }
+  struct run_ring *r = &q->levels[level];
   struct co *co;
-};
+  while ((co = r->slots[r->head++ & r->mask]) == NULL) {}
+  run_ring_taken_(q, r, co);
+  return co;
+}
 
-struct list {
-  int len;
-  struct list_node *head;
-  struct list_node *tail;
-};
+static void run_queue_destroy_(struct run_queue *q) {
+  for (int level = 0; level < CO_PRIORITY_NUM; level++) {
+    free(q->levels[level].slots);
+  }
+}
 
-static void list_init_(struct list *list) {
-  list->len = 0;
-  list->head = malloc(sizeof(struct list_node));
-  if (list->head == NULL) {
-    panic("malloc for list->head fails");
+static struct co *co_start_ex_(struct co_scheduler *s, const char *name, void (*func)(void *), void *arg,
+                               const co_attr_t *attr);
+static void shared_stack_unmap_all_(struct co_scheduler *s);
+
+// The dead coroutines started by co_post cannot be released as they die, since the switch away from them still uses
+// them. The one that is dying, if any, is the current one at the back of the list.
+static void detached_release_(struct co_scheduler *s) {
+  while (s->detached_list.len > 0 && list_front_(&s->detached_list) != s->current) {
+    struct co *co = list_front_(&s->detached_list);
+    list_erase_(&s->detached_list, co);
+    co_release_(s, co);
   }
-  list->head->next = NULL;
-  list->head->co = NULL;
-  list->tail = list->head;
 }
 
-static void list_insert_after_(struct list *list, struct list_node *pos, struct list_node *node) {
-  list->len++;
-  node->co->prev = pos;
-  node->next = pos->next;
-  if (pos->next == NULL) {
-    list->tail = node;
-  } else {
-    pos->next->co->prev = node;
+static void scheduler_destroy_(struct co_scheduler *s) {
+  assert(s->current == s->main);
+  preempt_destroy_(s);
+  detached_release_(s);
+  assert(s->run_queue.len == 0);
+  assert(s->waiting_list.len == 0);
+  if (s->dead_list.len > 0) {
+    panic("dead coroutines not freed");
   }
-  pos->next = node;
+  co_release_(s, s->main);
+  co_arena_trim_(&s->co_arena);
+  assert(s->co_arena.slabs == 0);
+  stack_pool_trim_(&s->stack_pool, 0);
+  shared_stack_unmap_all_(s);
+  uring_destroy_(&s->uring);
+  inbox_destroy_(&s->inbox);
+  reactor_destroy_(&s->reactor);
+  chan_waiter_pool_destroy_(s);
+  trace_destroy_(s);
+  run_queue_destroy_(&s->run_queue);
+  free(s->stack_classes);
+  free(s);
+  tls_scheduler = NULL;
 }
 
-static struct list_node *list_erase_(struct list *list, struct list_node *node) {
-  list->len--;
-  node->co->prev->next = node->next;
-  if (node->next == NULL) {
-    list->tail = node->co->prev;
-  } else {
-    node->next->co->prev = node->co->prev;
+static pthread_key_t scheduler_key;
+static pthread_once_t scheduler_key_once = PTHREAD_ONCE_INIT;
+
+static void scheduler_key_destructor_(void *s) {
+  scheduler_destroy_(s);
+}
+
+static void scheduler_key_create_() {
+  if (pthread_key_create(&scheduler_key, scheduler_key_destructor_) != 0) {
+    panic("pthread_key_create fails");
+  }
+}
+
+struct co_scheduler *scheduler_create_() {
+  struct co_scheduler *s = aligned_alloc(CACHE_LINE_SIZE, (sizeof(struct co_scheduler) + CACHE_LINE_SIZE - 1) &
+                                                          ~(size_t) (CACHE_LINE_SIZE - 1));
+  if (s == NULL) {
+    panic("aligned_alloc for co_scheduler fails");
+  }
+  memset(s, 0, sizeof(struct co_scheduler));
+  list_init_(&s->waiting_list);
+  list_init_(&s->dead_list);
+  list_init_(&s->detached_list);
+  s->stack_pool.cap = STACK_POOL_DEFAULT_CAP;
+  list_head_init_(&s->co_arena.partial);
+  reactor_init_(&s->reactor);
+  uring_init_(&s->uring);
+  inbox_init_(&s->inbox);
+  timer_wheel_init_(&s->timer_wheel);
+#ifdef COROUTINE_STATS
+  s->stats.base_ns = s->stats.window_ns = clock_ns_();
+  s->stats.base_cycles = stats_cycles_();
+#endif
+  tls_scheduler = s;
+  struct co *main = co_alloc_(&s->co_arena);
+  co_init_(s, main, "main", NULL, NULL, NULL); // running, so not queued
+  s->main = main;
+  s->current = main;
+  pthread_once(&scheduler_key_once, scheduler_key_create_);
+  pthread_setspecific(scheduler_key, s);
+  return s;
+}
+
+co_scheduler_t *co_scheduler_self() {
+  struct co_scheduler *s = sched_();
+  if (s->worker == NULL) {
+    inbox_setup_(s); // it may be handed to co_post, whose caller counts on a sleeping scheduler to wake up
+  }
+  return s;
+}
+
+// Unlike the other calls, this one does not create a scheduler: the hooks of libcoroutine-hook ask it on every call.
+struct co *co_self() {
+  struct co_scheduler *s = tls_scheduler;
+  return s != NULL && s->current != s->main ? s->current : NULL;
+}
+
+void co_stack_pool_config(size_t cap, size_t prewarm) {
+  struct co_scheduler *s = sched_();
+  s->stack_pool.cap = cap;
+  stack_pool_trim_(&s->stack_pool, cap);
+  if (prewarm > cap) {
+    prewarm = cap;
+  }
+  while (s->stack_pool.size < prewarm) {
+    stack_free_(&s->stack_pool, stack_map_(CO_STACK_DEFAULT_KIND, COROUTINE_STACK_SIZE), CO_STACK_DEFAULT_KIND,
+                COROUTINE_STACK_SIZE);
+  }
+}
+
+void co_stack_pool_get_stats(struct co_stack_pool_stats *stats) {
+  struct co_scheduler *s = sched_();
+  stats->hits = s->stack_pool.hits;
+  stats->misses = s->stack_pool.misses;
+  stats->size = s->stack_pool.size;
+  stats->cap = s->stack_pool.cap;
+}
+
+void co_stack_paint(int enable) {
+  sched_()->stack_paint = enable;
+}
+
+void co_stack_adaptive(int enable) {
+  sched_()->stack_adaptive = enable;
+}
+
+// The slot of func in the table of stack classes, empty if it has none yet. The table is never full.
+static struct stack_class *stack_class_find_(struct co_scheduler *s, void (*func)(void *)) {
+  size_t mask = s->stack_class_cap - 1;
+  size_t i = (size_t) (((uint64_t) (uintptr_t) func * 0x9e3779b97f4a7c15) >> 32) & mask;
+  while (s->stack_classes[i].func != NULL && s->stack_classes[i].func != func) {
+    i = (i + 1) & mask;
+  }
+  return &s->stack_classes[i];
+}
+
+// The class of func, added to the table if it has none yet.
+static struct stack_class *stack_class_get_(struct co_scheduler *s, void (*func)(void *)) {
+  if ((s->stack_class_len + 1) * 4 > s->stack_class_cap * 3) {
+    struct stack_class *old = s->stack_classes;
+    size_t old_cap = s->stack_class_cap;
+    s->stack_class_cap = old_cap > 0 ? old_cap * 2 : 16;
+    s->stack_classes = calloc(s->stack_class_cap, sizeof(struct stack_class));
+    if (s->stack_classes == NULL) {
+      panic("calloc for stack classes fails");
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].func != NULL) {
+        *stack_class_find_(s, old[i].func) = old[i];
+      }
+    }
+    free(old);
+  }
+  struct stack_class *c = stack_class_find_(s, func);
+  if (c->func == NULL) {
+    memset(c, 0, sizeof(struct stack_class));
+    c->func = func;
+    s->stack_class_len++;
   }
-  return node;
+  return c;
 }
 
-static void list_push_back_(struct list *list, struct list_node *node) {
-  list_insert_after_(list, list->tail, node);
+static void stack_class_learn_(struct co_scheduler *s, void (*func)(void *), size_t peak) {
+  struct stack_class *c = stack_class_get_(s, func);
+  c->samples++;
+  c->probing = false;
+  if (peak > c->peak) {
+    c->peak = peak;
+  }
+}
+
+// Sizes the stack of co from the class of its entry function: twice the peak rounded up to a power of 2, so that the
+// stack pool has it, measured again for one coroutine in STACK_ADAPTIVE_RESAMPLE. Before a sample exists, a single
+// coroutine probes on a stack large enough for the deep ones, and the others get the default size.
+static void stack_class_assign_(struct co_scheduler *s, struct co *co) {
+  struct stack_class *c = stack_class_get_(s, co->func);
+  if (c->samples == 0) {
+    if (!c->probing) {
+      c->probing = true;
+      co->stack_size = STACK_ADAPTIVE_PROBE_SIZE;
+      co->stack_painted = true;
+    }
+    return;
+  }
+  size_t size = STACK_ADAPTIVE_MIN_SIZE;
+  while (size < c->peak * 2) {
+    size *= 2;
+  }
+  co->stack_size = size;
+  if (c->spawns++ % STACK_ADAPTIVE_RESAMPLE == 0) {
+    co->stack_painted = true;
+  }
 }
 
-static struct list_node *list_front_(struct list *list) {
-  assert(list->len > 0);
-  return list->head->next;
+// The start of the lowest resident page of a mapped stack, or its top if none is. The pages below it were never
+// written, so they hold no frame and are neither painted nor scanned, which would commit them.
+static uint8_t *stack_touched_(uint8_t *stack, size_t size) {
+  unsigned char vec[64];
+  size_t pages = size / page_size;
+  for (size_t i = 0; i < pages; i += sizeof(vec)) {
+    size_t n = pages - i < sizeof(vec) ? pages - i : sizeof(vec);
+    if (mincore(stack + i * page_size, n * page_size, vec) != 0) {
+      return stack;
+    }
+    for (size_t j = 0; j < n; j++) {
+      if (vec[j] & 1) {
+        return stack + (i + j) * page_size;
+      }
+    }
+  }
+  return stack + size;
 }
 
-static void list_free_(struct list_node *list_head) {
-  struct list_node *cur = list_head;
-  while (cur != NULL) {
-    struct list_node *next = cur->next;
-    free(cur);
-    cur = next;
+// How deep the painted stack of co has been used: up to its lowest word that no longer holds the paint. Unlike
+// zero-filled pages, the paint tells a frame that stored zeros from memory that was never written. On a mapped stack,
+// only the resident pages are painted, so the depth of a fresh one is rounded up to a page.
+static size_t stack_scan_(struct co *co) {
+  uint8_t *p = co->stack_kind == CO_STACK_MMAP ? stack_touched_(co->stack, co->stack_size) : co->stack;
+  uint8_t *top = co->stack + co->stack_size;
+  while (p < top && *(uintptr_t *) p == STACK_PAINT_WORD) {
+    p += sizeof(uintptr_t);
   }
+  return top - p;
 }
 
-static inline struct list_node *belong_node_(const struct co *co) {
-  return co->prev->next;
+size_t co_stack_high_water(struct co *co) {
+  if (!co->stack_painted) {
+    return 0;
+  }
+  return co->stack != NULL ? stack_scan_(co) : co->stack_peak;
 }
 
-// ready_list, waiting_list, dead_list are exclusive. All coroutine must belong to one and only one of them.
-struct list ready_list;   // status: CO_NEW/CO_RUNNING
-struct list waiting_list; // status: CO_WAITING
-struct list dead_list;    // status: CO_DEAD
+static void co_stack_alloc_(struct co_scheduler *s, struct co *co) {
+  co->stack = stack_alloc_(&s->stack_pool, co->stack_kind, co->stack_size);
+  if (!co->stack_painted) {
+    return;
+  }
+  // A fresh mapping needs no paint, and a pooled one only on the pages its earlier owners touched.
+  uint8_t *p = co->stack_kind == CO_STACK_MMAP ? stack_touched_(co->stack, co->stack_size) : co->stack;
+  memset(p, STACK_PAINT_BYTE, co->stack + co->stack_size - p);
+}
+
+// Gives stacks to the CO_STACK_MMAP coroutines of a batch, which have the same stack size, before they first run. The
+// stacks the pool cannot provide are carved out of a single mapping, each above its own guard page, which is unmapped
+// when the last of them dies instead of one stack at a time.
+static void co_stack_alloc_batch_(struct co_scheduler *s, struct co **cos, size_t n) {
+  size_t size = cos[0]->stack_size;
+  size_t i = 0;
+  int class = stack_pool_class_(size);
+  if (class >= 0) {
+    for (; i < n && s->stack_pool.head[CO_STACK_MMAP][class] != NULL; i++) {
+      co_stack_alloc_(s, cos[i]);
+    }
+    s->stack_pool.misses += n - i;
+  }
+  if (i == n) {
+    return;
+  }
+  struct stack_batch *batch = malloc(sizeof(struct stack_batch));
+  if (batch == NULL) {
+    panic("malloc for stack_batch fails");
+  }
+  stats_inc_(s, heap_allocs);
+  size_t span = size + page_size;
+  batch->size = (n - i) * span;
+  batch->live = n - i;
+  batch->map = mmap(NULL, batch->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                    -1, 0);
+  if (batch->map == MAP_FAILED) {
+    panic("mmap for stack fails");
+  }
+  for (uint8_t *map = batch->map; i < n; i++, map += span) {
+    if (mprotect(map, page_size, PROT_NONE) != 0) {
+      panic("mprotect for stack guard page fails");
+    }
+    cos[i]->stack = map + page_size;
+    cos[i]->stack_batch = batch;
+  }
+}
+
+static void stack_batch_put_(struct stack_batch *batch) {
+  if (--batch->live == 0) {
+    munmap(batch->map, batch->size);
+    free(batch);
+  }
+}
+
+static struct shared_stack *shared_stack_assign_(struct co_scheduler *s) {
+  struct shared_stack *shared = &s->shared_stacks[s->shared_stack_next];
+  s->shared_stack_next = (s->shared_stack_next + 1) % SHARED_STACK_NUM;
+  if (shared->stack == NULL) {
+    shared->stack = stack_map_(CO_STACK_MMAP, SHARED_STACK_SIZE);
+  }
+  return shared;
+}
+
+static void shared_stack_unmap_all_(struct co_scheduler *s) {
+  for (int i = 0; i < SHARED_STACK_NUM; i++) {
+    if (s->shared_stacks[i].stack != NULL) {
+      stack_unmap_(s->shared_stacks[i].stack, CO_STACK_MMAP, SHARED_STACK_SIZE);
+    }
+  }
+}
 
 static void initialize_();
-static inline void stack_switch_call_(void *sp, void *entry, void *arg);
-static void schedule_to_(struct co *co);
-static void schedule_();
+static void schedule_to_(struct co_scheduler *s, struct co *co);
+static void schedule_(struct co_scheduler *s);
 static void dead_handler_(struct co *co);
-static void co_wrapper_(struct co *co);
 static void cleanup_();
 
 __attribute__ ((constructor))
 static void initialize_() {
-  list_init_(&ready_list);
-  list_init_(&waiting_list);
-  list_init_(&dead_list);
-  current = co_start("main", NULL, NULL);
+  page_size = sysconf(_SC_PAGESIZE);
 }
 
 struct co *co_start(const char *name, void (*func)(void *), void *arg) {
-  struct co *co = malloc(sizeof(struct co));
-  if (co == NULL) {
-    panic("malloc for co fails");
+  return co_start_ex(name, func, arg, NULL);
+}
+
+struct co *co_start_ex(const char *name, void (*func)(void *), void *arg, const co_attr_t *attr) {
+  if (__atomic_load_n(&runtime_running, __ATOMIC_ACQUIRE)) {
+    return runtime_spawn_(name, func, arg, attr);
+  }
+  return co_start_ex_(sched_(), name, func, arg, attr);
+}
+
+static struct co *co_new_(struct co_scheduler *s, const char *name, void (*func)(void *), void *arg,
+                          const co_attr_t *attr) {
+  struct co *co = co_alloc_(&s->co_arena);
+  co_init_(s, co, name, func, arg, attr);
+  if (co->stack_kind != CO_STACK_SHARED) {
+    co->stack_painted = s->stack_paint;
+    if (s->stack_adaptive && co->stack_kind == CO_STACK_MMAP && (attr == NULL || attr->stack_size == 0)) {
+      stack_class_assign_(s, co);
+    }
+  }
+  return co;
+}
+
+static struct co *co_start_ex_(struct co_scheduler *s, const char *name, void (*func)(void *), void *arg,
+                               const co_attr_t *attr) {
+  struct co *co = co_new_(s, name, func, arg, attr);
+  run_queue_push_(&s->run_queue, co, false);
+  return co;
+}
+
+struct co *co_start_detached_(struct co_scheduler *s, const char *name, void (*func)(void *), void *arg) {
+  detached_release_(s);
+  struct co *co = co_start_ex_(s, name, func, arg, NULL);
+  co->detached = true;
+  return co;
+}
+
+void co_start_batch(struct co **cos, size_t n, const char *name, void (*func)(void *), void *const *args,
+                    const co_attr_t *attr) {
+  if (__atomic_load_n(&runtime_running, __ATOMIC_ACQUIRE)) {
+    for (size_t i = 0; i < n; i++) {
+      cos[i] = runtime_spawn_(name, func, args != NULL ? args[i] : NULL, attr);
+    }
+    return;
+  }
+  if (n == 0) {
+    return;
   }
-  co->name = malloc(strlen(name) + 1);
-  if (co->name == NULL) {
-    panic("malloc for co->name fails");
+  struct co_scheduler *s = sched_();
+  for (size_t i = 0; i < n; i++) {
+    cos[i] = co_new_(s, name, func, args != NULL ? args[i] : NULL, attr);
+  }
+  if (cos[0]->stack_kind == CO_STACK_MMAP) {
+    co_stack_alloc_batch_(s, cos, n);
+  }
+  run_queue_push_batch_(&s->run_queue, cos, n);
+}
+
+void co_init_(struct co_scheduler *s, struct co *co, const char *name, void (*func)(void *), void *arg,
+              const co_attr_t *attr) {
+  size_t name_size = strlen(name) + 1;
+  if (name_size <= CO_INLINE_NAME_SIZE) {
+    co->name = co->inline_name;
+  } else {
+    co->name = malloc(name_size);
+    if (co->name == NULL) {
+      panic("malloc for co->name fails");
+    }
+    if (s != NULL) { // NULL for runtime coroutines
+      stats_inc_(s, heap_allocs);
+    }
   }
-  strcpy(co->name, name);
+  memcpy(co->name, name, name_size);
   co->func = func;
   co->arg = arg;
+  co->sched = s;
   co->status = CO_NEW;
-  co->waiter_list_head = NULL;
-  struct list_node *node = malloc(sizeof(struct list_node));
-  if (node == NULL) {
-    panic("malloc for node fails");
+  co->lock = 0;
+  co->runtime = false;
+  co->released = false;
+  co->park_state = 0;
+  co->woken = false;
+  co->stack = NULL;
+  co->stack_kind = attr != NULL ? attr->stack_kind : CO_STACK_DEFAULT_KIND;
+  co->level = priority_level_(attr != NULL ? attr->priority : CO_PRIORITY_NORMAL);
+  co->queued = false;
+  co->stack_painted = false;
+  co->stack_peak = 0;
+  co->stack_batch = NULL;
+  if (co->stack_kind == CO_STACK_SHARED) {
+    co->stack_size = SHARED_STACK_SIZE;
+    co->shared_stack = shared_stack_assign_(s);
+  } else {
+    co->stack_size = stack_round_size_(co->stack_kind,
+                                       attr != NULL && attr->stack_size != 0 ? attr->stack_size : COROUTINE_STACK_SIZE);
+    co->shared_stack = NULL;
   }
-  node->co = co;
-  list_push_back_(&ready_list, node);
-  return co;
+  co->save_buf = NULL;
+  co->save_size = 0;
+  co->save_cap = 0;
+  list_head_init_(&co->waiters);
+  list_head_init_(&co->wait_link);
+  list_head_init_(&co->timer_link);
+  co->timed_out = false;
+  co->io_result = 0;
+  co->select = NULL;
+  co->caller = NULL;
+  co->value = NULL;
+  co->transfer_parked = false;
+  co->detached = false;
+  co->parked = false;
+  co->permit = false;
+  co->wake_posted = 0;
+  co->release_on_wake = false;
+#ifdef COROUTINE_TRACE
+  co->trace_id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+  if (s != NULL) {
+    trace_start_(s, co);
+  }
+#endif
+#ifdef COROUTINE_STATS
+  memset(&co->stats, 0, sizeof(co->stats));
+  co->stats_at = stats_cycles_();
+  co->stats_parked = false;
+  if (s != NULL && s->main != NULL) {
+    s->stats.started++;
+  }
+#endif
 }
 
-static inline void stack_switch_call_(void *sp, void *entry, void *arg) {
-  asm volatile (
+#ifndef COROUTINE_USE_SETJMP
+asm (
+    ".text\n"
+    ".globl context_swap_\n"
+    ".hidden context_swap_\n"
+    ".type context_swap_, @function\n"
+    ".p2align 4\n"
+    "context_swap_:\n"
 #if __x86_64__
-      "movq %0, %%rsp; movq %2, %%rdi; jmp *%1"
-      :
-      : "b"((uintptr_t) sp - 8), "d"(entry), "a"(arg)
-      : "memory"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
 #else
-    "movl %0, %%esp; movl %2, 4(%0); jmp *%1"
-    :
-    : "b"((uintptr_t) sp - 8), "d"(entry), "a"(arg)
-    : "memory"
+    "  movl 4(%esp), %eax\n"
+    "  movl 8(%esp), %edx\n"
+    "  pushl %ebp\n"
+    "  pushl %ebx\n"
+    "  pushl %esi\n"
+    "  pushl %edi\n"
+    "  movl %esp, (%eax)\n"
+    "  movl %edx, %esp\n"
+    "  popl %edi\n"
+    "  popl %esi\n"
+    "  popl %ebx\n"
+    "  popl %ebp\n"
+    "  ret\n"
 #endif
-      );
+    ".size context_swap_, .-context_swap_\n"
+    ".globl context_entry_\n"
+    ".hidden context_entry_\n"
+    ".type context_entry_, @function\n"
+    ".p2align 4\n"
+    "context_entry_:\n"
+#if __x86_64__
+    "  movq %r13, %rdi\n"
+    "  callq *%r12\n"
+#else
+    "  subl $12, %esp\n"
+    "  pushl %esi\n"
+    "  calll *%edi\n"
+#endif
+    "  ud2\n"
+    ".size context_entry_, .-context_entry_\n"
+    );
+#endif
+
+// Runs on shared_switch_stack: saves the frames of the owner of the shared stack of co, puts the frames of co back
+// and switches to co.
+static void shared_stack_switch_(struct co *co) {
+  struct shared_stack *shared = co->shared_stack;
+  uint8_t *top = shared->stack + SHARED_STACK_SIZE;
+  struct co *owner = shared->owner;
+  if (owner != NULL) {
+    uint8_t *sp = context_sp_(&owner->context);
+    owner->save_size = top - sp;
+    if (owner->save_cap < owner->save_size || owner->save_cap > 4 * owner->save_size) {
+      free(owner->save_buf);
+      owner->save_buf = malloc(owner->save_size);
+      if (owner->save_buf == NULL) {
+        panic("malloc for co->save_buf fails");
+      }
+      stats_inc_(owner->sched, heap_allocs);
+      owner->save_cap = owner->save_size;
+    }
+    memcpy(owner->save_buf, sp, owner->save_size);
+  }
+  shared->owner = co;
+  if (co->status == CO_NEW) {
+    context_make_(&co->context, top, co_wrapper_, co);
+  } else {
+    memcpy(top - co->save_size, co->save_buf, co->save_size);
+  }
+  context_switch_(&co->sched->shared_switch_context, &co->context);
 }
 
-static void schedule_to_(struct co *co) {
-  current = co;
-  switch (current->status) {
+// Saves the context of current and switches to co.
+static void schedule_to_(struct co_scheduler *s, struct co *co) {
+  struct co *prev = s->current;
+  if (prev == co) {
+    return; // context_swap_ would resume from the stack pointer saved before this switch
+  }
+  if (co->queued) {
+    run_queue_remove_(&s->run_queue, co); // a directed switch
+  }
+  s->current = co;
+  preempt_switch_(s);
+  stats_switch_(s, prev, co, prev->status == CO_WAITING, __builtin_frame_address(0));
+  trace_switch_(s, prev, co);
+  switch (co->status) {
     case CO_NEW:
-      current->stack = malloc(COROUTINE_STACK_SIZE);
-      if (current->stack == NULL) {
-        panic("malloc for co->stack fails");
+      if (co->stack_kind != CO_STACK_SHARED) {
+        if (co->stack == NULL) { // given by co_start_batch otherwise
+          co_stack_alloc_(s, co);
+        }
+        context_make_(&co->context, co->stack + co->stack_size, co_wrapper_, co);
       }
-      stack_switch_call_(current->stack + COROUTINE_STACK_SIZE, co_wrapper_, current);
+      // fallthrough
     case CO_RUNNING:
-      longjmp(current->context, 1);
+      if (co->stack_kind == CO_STACK_SHARED && co->shared_stack->owner != co) {
+        // the shared stack may be the one we are running on, so it is overwritten from another stack
+        context_make_(&s->shared_switch_context, s->shared_switch_stack + RUNTIME_STACK_SIZE, shared_stack_switch_, co);
+        context_switch_(&prev->context, &s->shared_switch_context);
+      } else {
+        context_switch_(&prev->context, &co->context);
+      }
+      break;
     case CO_WAITING:
     case CO_DEAD:
       assert(false);
   }
 }
 
-static void schedule_() {
-  if (ready_list.len == 0) {
+// Moves the coroutines whose descriptors are ready or whose timers have expired to run_queue. If run_queue is empty,
+// waits until there is one of them, unless there is nothing to wait for.
+static void scheduler_poll_(struct co_scheduler *s) {
+  do {
+    int timeout = timer_wheel_advance_(s, &s->timer_wheel);
+    uring_flush_(s); // one submission for all the operations queued since the last poll
+    if (s->run_queue.len > 0) {
+      timeout = 0;
+    } else if (timeout < 0 && s->reactor.waiters == 0) {
+      return;
+    }
+    // the completions reaped just now need no epoll_wait, a sleep until a timer does when other threads may post
+    if (s->reactor.waiters > (int) s->uring.inflight || ((s->uring.inflight > 0 || s->inbox.fd >= 0) && timeout != 0)) {
+      reactor_poll_(s, timeout);
+    } else if (timeout > 0) {
+      struct timespec ts = {timeout / 1000, timeout % 1000 * 1000000L};
+      while (sys_nanosleep_(&ts, &ts) != 0 && errno == EINTR) {}
+    }
+  } while (s->run_queue.len == 0);
+}
+
+static void schedule_(struct co_scheduler *s) {
+  // What other threads posted is taken at every switch, with one load when there is nothing.
+  if (__atomic_load_n(&s->inbox.head, __ATOMIC_RELAXED) != NULL) {
+    inbox_drain_(s);
+  }
+  // Coroutines parked on I/O or timers are polled for once in a while, and waited for when there is nothing else to
+  // run.
+  if ((s->reactor.waiters > 0 || s->timer_wheel.count > 0) &&
+      (s->run_queue.len == 0 || ++s->poll_tick % POLL_INTERVAL == 0)) {
+    scheduler_poll_(s);
+  }
+  if (s->run_queue.len == 0) {
     panic("no coroutine to schedule");
   }
-  schedule_to_(list_front_(&ready_list)->co);
+  schedule_to_(s, run_queue_pop_(&s->run_queue));
 }
 
 static void dead_handler_(struct co *co) {
-  free(co->stack);
+  struct co_scheduler *s = co->sched;
+  if (co->stack_kind == CO_STACK_SHARED) {
+    if (co->shared_stack->owner == co) {
+      co->shared_stack->owner = NULL;
+    }
+    free(co->save_buf);
+    co->save_buf = NULL;
+    co->save_cap = 0;
+  } else {
+    if (co->stack_painted) {
+      co->stack_peak = stack_scan_(co);
+      if (s->stack_adaptive) {
+        stack_class_learn_(s, co->func, co->stack_peak);
+      }
+    }
+    if (co->stack_batch != NULL) {
+      stack_batch_put_(co->stack_batch);
+      co->stack_batch = NULL;
+    } else {
+      stack_free_(&s->stack_pool, co->stack, co->stack_kind, co->stack_size);
+    }
+  }
   co->stack = NULL;
-  schedule_();
+  if (co->caller != NULL) {
+    // a generator that is done goes straight back to its co_gen_next
+    struct co *caller = co->caller;
+    co->caller = NULL;
+    schedule_to_(s, caller);
+  } else {
+    schedule_(s);
+  }
 }
 
-static void co_wrapper_(struct co *co) {
+void co_wrapper_(struct co *co) {
   co->func(co->arg);
+  if (co->runtime) {
+    runtime_switch_out_(tls_scheduler, co, RUNTIME_EXIT, NULL);
+  }
+  struct co_scheduler *s = co->sched;
   co->status = CO_DEAD;
-  list_push_back_(&dead_list, list_erase_(&ready_list, belong_node_(current)));
-  for (waiter_list_node *waiter_node = co->waiter_list_head; waiter_node != NULL; waiter_node = waiter_node->next) {
-    waiter_node->co->status = CO_RUNNING;
-    list_push_back_(&ready_list, list_erase_(&waiting_list, belong_node_(waiter_node->co)));
+  list_push_back_(co->detached ? &s->detached_list : &s->dead_list, co);
+  for (struct list_head *node = co->waiters.next; node != &co->waiters;) {
+    struct co *waiter = list_entry_(node, struct co, wait_link);
+    node = node->next;
+    list_head_init_(&waiter->wait_link);
+    timer_cancel_(&s->timer_wheel, waiter); // armed by co_wait_timeout
+    co_unblock_(s, waiter);
   }
-  list_free_(co->waiter_list_head);
-  co->waiter_list_head = NULL;
-  stack_switch_call_(runtime_stack + RUNTIME_STACK_SIZE, dead_handler_, co);
+  list_head_init_(&co->waiters);
+  trace_reason_(s, TRACE_EXIT);
+  if (co->caller != NULL) {
+    // dead_handler_ switches straight to it
+    co->caller->transfer_parked = false;
+    co->caller->status = CO_RUNNING;
+    list_erase_(&s->waiting_list, co->caller);
+  }
+  stack_switch_call_(s->runtime_stack + RUNTIME_STACK_SIZE, dead_handler_, co);
 }
 
 void co_yield() {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
   assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (current->runtime) {
+    runtime_switch_out_(s, current, RUNTIME_YIELD, NULL);
+    return;
+  }
   current->status = CO_RUNNING;
-  list_push_back_(&ready_list, list_erase_(&ready_list, belong_node_(current))); // lower the priority of current
-  if (setjmp(current->context) == 0) {
-    schedule_();
+  run_queue_push_(&s->run_queue, current, false);
+  trace_reason_(s, TRACE_YIELD);
+  schedule_(s);
+}
+
+int co_preempt_point() {
+  struct co_scheduler *s = tls_scheduler;
+  if (s == NULL || !s->preempt.expired) {
+    return 0;
+  }
+  s->preempt.expired = 0;
+  stats_inc_(s, preemptions);
+  struct co *current = s->current;
+  if (current->runtime) {
+    runtime_switch_out_(s, current, RUNTIME_YIELD, NULL);
+    return 1;
   }
+  current->status = CO_RUNNING;
+  run_queue_push_(&s->run_queue, current, false);
+  trace_reason_(s, TRACE_PREEMPT);
+  schedule_(s);
+  return 1;
 }
 
 void co_wait(struct co *co) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
   assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (co->runtime) {
+    runtime_wait_(s, current, co);
+    return;
+  }
+  assert(co->sched == s);
   if (co->status == CO_DEAD) {
     return;
   }
   current->status = CO_WAITING;
-  list_push_back_(&waiting_list, list_erase_(&ready_list, belong_node_(current)));
-  waiter_list_node *waiter_node = malloc(sizeof(waiter_list_node));
-  if (waiter_node == NULL) {
-    panic("malloc for waiter_node fails");
-  }
-  waiter_node->co = current;
-  waiter_node->next = co->waiter_list_head;
-  co->waiter_list_head = waiter_node;
-  if (setjmp(current->context) == 0) {
-    schedule_();
-  }
+  list_push_back_(&s->waiting_list, current);
+  list_head_add_tail_(&co->waiters, &current->wait_link);
+  trace_reason_(s, TRACE_WAIT);
+  schedule_(s);
 }
 
 void co_resume(struct co *co) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
   assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (current->runtime || co->runtime) {
+    // runtime coroutines are only run by the workers, all a runtime coroutine can do is give its worker up
+    if (current->runtime) {
+      co_yield();
+    }
+    return;
+  }
+  assert(co->sched == s);
   switch (co->status) {
+    case CO_WAITING:
+      if (!co->transfer_parked) {
+        panic("resuming a coroutine of status CO_WAITING"); // TODO: cascading wait
+      }
+      // parked by co_transfer, handed control back
+      co->transfer_parked = false;
+      co->status = CO_RUNNING;
+      list_erase_(&s->waiting_list, co);
+      // fallthrough
     case CO_NEW:
     case CO_RUNNING:
       current->status = CO_RUNNING;
-      if (setjmp(current->context) == 0) {
-        schedule_to_(co);
+      if (co != current) {
+        run_queue_push_(&s->run_queue, current, true); // current keeps its place
+        trace_reason_(s, TRACE_RESUME);
+        schedule_to_(s, co);
       }
       break;
-    case CO_WAITING:
-      panic("resuming a coroutine of status CO_WAITING"); // TODO: cascading wait
     case CO_DEAD:
       break;
   }
 }
 
+// Parks the current coroutine until a coroutine transfers back to it, and switches straight to co, which is ready or
+// parked by a transfer.
+static void co_transfer_park_(struct co_scheduler *s, struct co *co) {
+  struct co *current = s->current;
+  if (co->status == CO_WAITING) {
+    if (!co->transfer_parked) {
+      panic("transferring to a coroutine waiting for something else");
+    }
+    co->transfer_parked = false;
+    co->status = CO_RUNNING;
+    list_erase_(&s->waiting_list, co);
+  }
+  current->status = CO_WAITING;
+  current->transfer_parked = true;
+  list_push_back_(&s->waiting_list, current);
+  trace_reason_(s, TRACE_TRANSFER);
+  schedule_to_(s, co);
+}
+
+void co_transfer(struct co *co) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (current->runtime || co->runtime) {
+    panic("co_transfer is not supported by runtime coroutines");
+  }
+  assert(co->sched == s);
+  if (co == current) {
+    return;
+  }
+  if (co->status == CO_DEAD || (co->status == CO_WAITING && !co->transfer_parked)) {
+    panic("transferring to a coroutine that is neither ready nor parked by a transfer");
+  }
+  // the caller is off the ready list until a co_transfer or co_resume hands control back to it
+  co_transfer_park_(s, co);
+}
+
+int co_gen_next(struct co *gen, void **value) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (current->runtime || gen->runtime) {
+    panic("generators are not supported by runtime coroutines");
+  }
+  assert(gen->sched == s && gen != current && gen->caller == NULL);
+  if (gen->status == CO_DEAD) {
+    return -1;
+  }
+  gen->caller = current;
+  co_transfer_park_(s, gen);
+  if (gen->status == CO_DEAD) {
+    return -1;
+  }
+  if (value != NULL) {
+    *value = gen->value;
+  }
+  return 0;
+}
+
+void co_yield_value(void *value) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  struct co *caller = current->caller;
+  if (caller == NULL) {
+    panic("co_yield_value outside of co_gen_next");
+  }
+  current->caller = NULL;
+  current->value = value;
+  co_transfer_park_(s, caller);
+}
+
+// Parks the current coroutine until co_unblock_ is called on it.
+void co_block_(struct co_scheduler *s) {
+  struct co *current = s->current;
+  current->status = CO_WAITING;
+  list_push_back_(&s->waiting_list, current);
+  trace_reason_(s, TRACE_BLOCK);
+  schedule_(s);
+}
+
+void co_unblock_(struct co_scheduler *s, struct co *co) {
+  assert(co->status == CO_WAITING);
+  co->status = CO_RUNNING;
+  list_erase_(&s->waiting_list, co);
+  run_queue_push_(&s->run_queue, co, false);
+}
+
+void co_set_priority(struct co *co, enum co_priority priority) {
+  uint8_t level = priority_level_(priority);
+  if (co->runtime) {
+    co->level = level; // the deques of the runtime have no levels
+    return;
+  }
+  struct co_scheduler *s = sched_();
+  assert(co->sched == s);
+  if (co->queued) {
+    run_queue_remove_(&s->run_queue, co);
+    co->level = level;
+    run_queue_push_(&s->run_queue, co, false);
+  } else {
+    co->level = level;
+  }
+}
+
+// A co_unpark from another thread as co finished may have left wake_node in the inbox: nothing drains it on the switch
+// to a generator's caller, nor before a co_free right after co_wait. co is then released by wake_handler_ instead.
+// Taking wake_posted otherwise keeps the wake-ups that come later out of the inbox.
+void co_release_(struct co_scheduler *s, struct co *co) {
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&co->wake_posted, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    co->release_on_wake = true;
+    return;
+  }
+  if (co->name != co->inline_name) {
+    free(co->name);
+  }
+  co_dealloc_(&s->co_arena, co);
+}
+
 void co_free(struct co *co) {
   assert(co != NULL);
+  if (co->runtime) {
+    runtime_free_(co);
+    return;
+  }
+  struct co_scheduler *s = sched_();
+  assert(co->sched == s);
   assert(co->status == CO_DEAD);
-  free(co->name);
-  list_free_(co->waiter_list_head);
-  free(list_erase_(&dead_list, belong_node_(co)));
-  free(co);
+  list_erase_(&s->dead_list, co);
+  co_release_(s, co);
 }
 
+void co_free_batch(struct co **cos, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    co_free(cos[i]);
+  }
+}
+
+void co_arena_release() {
+  struct co_scheduler *s = sched_();
+  detached_release_(s);
+  while (s->dead_list.len > 0) {
+    struct co *co = list_front_(&s->dead_list);
+    list_erase_(&s->dead_list, co);
+    co_release_(s, co);
+  }
+  co_arena_trim_(&s->co_arena);
+}
+
+// The main thread does not run the destructor of scheduler_key when it returns from main.
 __attribute__((destructor))
 static void cleanup_() {
-  assert(strcmp(current->name, "main") == 0);
-  assert(ready_list.len == 1);
-  assert(waiting_list.len == 0);
-  if (dead_list.len > 0) {
-    panic("dead coroutines not freed");
+  if (tls_scheduler != NULL) {
+    pthread_setspecific(scheduler_key, NULL);
+    scheduler_destroy_(tls_scheduler);
   }
-  free(current->name);
-  list_free_(current->waiter_list_head);
-  free(current);
-  list_free_(ready_list.head);
-  list_free_(waiting_list.head);
-  list_free_(dead_list.head);
 }
@@ -1,12 +1,178 @@
 #ifndef COROUTINE_IN_C_COROUTINE_H
 #define COROUTINE_IN_C_COROUTINE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
 typedef struct co coroutine_t;
+typedef struct co_scheduler co_scheduler_t;
+typedef struct co_chan co_chan_t;
+typedef struct co_mutex co_mutex_t;
+typedef struct co_cond co_cond_t;
+typedef struct co_sem co_sem_t;
+typedef struct co_waitgroup co_waitgroup_t;
+
+enum co_stack_kind {
+  CO_STACK_MMAP,  // mmap'ed with a guard page, pages are committed on first touch (default)
+  CO_STACK_MALLOC, // plain malloc'ed buffer without overflow protection
+  CO_STACK_SHARED  // runs on one of a few 256KB shared stacks, the used part is copied out when switched out
+};
+
+enum co_priority {
+  CO_PRIORITY_NORMAL, // default
+  CO_PRIORITY_HIGH,   // latency-critical, picked before the other levels
+  CO_PRIORITY_LOW     // batch work, picked after the other levels
+};
+
+typedef struct co_attr {
+  size_t stack_size;             // 0 for the default size of 32KB, ignored by CO_STACK_SHARED
+  enum co_stack_kind stack_kind;
+  enum co_priority priority;     // ignored by runtime coroutines
+} co_attr_t;
+
+enum co_select_op {
+  CO_SELECT_SEND,  // send *elem to chan
+  CO_SELECT_RECV,  // receive from chan into *elem
+  CO_SELECT_READ,  // fd may be read without blocking
+  CO_SELECT_WRITE  // fd may be written without blocking
+};
+
+typedef struct co_select_case {
+  enum co_select_op op;
+  co_chan_t *chan;
+  void *elem;
+  int fd;
+  int ok; // set for the channel case chosen: 0, or -1 if the channel is closed
+} co_select_case_t;
+
+struct co_stack_pool_stats {
+  unsigned long hits;   // stacks taken from the pool
+  unsigned long misses; // stacks that had to be allocated
+  size_t size;          // stacks currently in the pool
+  size_t cap;
+};
+
+// Process-wide, the pool of co_run_blocking is shared by all the threads.
+struct co_blocking_pool_stats {
+  unsigned long submitted;
+  unsigned long completed;
+  unsigned long full_waits;  // calls that had to wait for room in the queue
+  size_t threads;            // threads started and not exited
+  size_t queued;             // calls waiting for a thread
+  size_t running;
+  uint64_t wait_ns_total;    // from the call to the start of fn on a thread
+  uint64_t wait_ns_max;
+  uint64_t latency_ns_total; // from the call to the resumption of the caller
+  uint64_t latency_ns_max;
+};
+
+// Cycles are those of the cycle counter of the CPU, see cycles_per_sec of co_scheduler_stats.
+struct co_stats {
+  uint64_t switches;       // times it was switched in
+  uint64_t run_cycles;     // running
+  uint64_t wait_cycles;    // switched out parked, until switched in again
+  uint64_t ready_cycles;   // switched out ready, until switched in again
+  size_t stack_high_water; // the deepest stack seen at a switch, in bytes
+};
+
+// The rates, averages and maxima are over the window since the previous call on the same scheduler.
+struct co_scheduler_stats {
+  uint64_t switches;
+  uint64_t uptime_ns;
+  uint64_t cycles_per_sec;
+  double switches_per_sec;
+  int ready_len;
+  int waiting_len;
+  double ready_len_avg; // sampled at every switch
+  double waiting_len_avg;
+  int ready_len_max;
+  int waiting_len_max;
+  unsigned long started;     // coroutines
+  unsigned long live;
+  unsigned long stack_maps;  // stacks that had to be mapped
+  unsigned long heap_allocs; // names, shared stack save buffers and channel waiters
+  unsigned long preemptions; // coroutines switched out at a safe point once their time slice expired
+  int slabs;
+};
 
+co_scheduler_t *co_scheduler_self();
+coroutine_t *co_self();
 coroutine_t *co_start(const char *name, void (*func)(void *), void *arg);
+coroutine_t *co_start_ex(const char *name, void (*func)(void *), void *arg, const co_attr_t *attr);
+void co_start_batch(coroutine_t **cos, size_t n, const char *name, void (*func)(void *), void *const *args,
+                    const co_attr_t *attr);
 void co_yield();
 void co_wait(coroutine_t *co);
 void co_resume(coroutine_t *co);
+void co_transfer(coroutine_t *co);
+void co_set_priority(coroutine_t *co, enum co_priority priority);
+int co_gen_next(coroutine_t *gen, void **value);
+void co_yield_value(void *value);
 void co_free(coroutine_t *co);
+void co_free_batch(coroutine_t **cos, size_t n);
+void co_arena_release();
+void co_stack_pool_config(size_t cap, size_t prewarm);
+void co_stack_pool_get_stats(struct co_stack_pool_stats *stats);
+void co_stack_paint(int enable);
+void co_stack_adaptive(int enable);
+size_t co_stack_high_water(coroutine_t *co);
+int co_stats(coroutine_t *co, struct co_stats *stats);
+int co_scheduler_stats(struct co_scheduler_stats *stats);
+int co_trace_start(size_t events);
+void co_trace_stop();
+int co_trace_export(const char *path);
+int co_preempt_start(uint64_t slice_ns);
+void co_preempt_stop();
+int co_preempt_point();
+void co_runtime_start(int workers);
+void co_runtime_stop();
+ssize_t co_read(int fd, void *buf, size_t count);
+ssize_t co_write(int fd, const void *buf, size_t count);
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int co_io_uring(int enable);
+void *co_run_blocking(void *(*fn)(void *), void *arg);
+void co_blocking_pool_config(size_t threads, size_t depth);
+void co_blocking_pool_get_stats(struct co_blocking_pool_stats *stats);
+int co_post(co_scheduler_t *sched, const char *name, void (*func)(void *), void *arg);
+void co_park();
+void co_unpark(coroutine_t *co);
+ssize_t co_recv(int fd, void *buf, size_t len, int flags);
+ssize_t co_send(int fd, const void *buf, size_t len, int flags);
+int co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int co_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int co_close(int fd);
+void co_sleep_ns(uint64_t ns);
+int co_wait_timeout(coroutine_t *co, uint64_t ns);
+co_chan_t *co_chan_new(size_t elem_size, size_t cap);
+void co_chan_free(co_chan_t *ch);
+int co_chan_send(co_chan_t *ch, const void *elem);
+int co_chan_recv(co_chan_t *ch, void *elem);
+size_t co_chan_send_n(co_chan_t *ch, const void *elems, size_t n);
+size_t co_chan_recv_n(co_chan_t *ch, void *elems, size_t n);
+void co_chan_close(co_chan_t *ch);
+int co_select(co_select_case_t *cases, int n, int64_t timeout_ns);
+co_mutex_t *co_mutex_new();
+void co_mutex_free(co_mutex_t *m);
+void co_mutex_lock(co_mutex_t *m);
+int co_mutex_trylock(co_mutex_t *m);
+void co_mutex_unlock(co_mutex_t *m);
+co_cond_t *co_cond_new();
+void co_cond_free(co_cond_t *c);
+void co_cond_wait(co_cond_t *c, co_mutex_t *m);
+void co_cond_signal(co_cond_t *c);
+void co_cond_broadcast(co_cond_t *c);
+co_sem_t *co_sem_new(unsigned int value);
+void co_sem_free(co_sem_t *sem);
+void co_sem_wait(co_sem_t *sem);
+int co_sem_trywait(co_sem_t *sem);
+void co_sem_post(co_sem_t *sem);
+co_waitgroup_t *co_waitgroup_new();
+void co_waitgroup_free(co_waitgroup_t *wg);
+void co_waitgroup_add(co_waitgroup_t *wg, int n);
+void co_waitgroup_done(co_waitgroup_t *wg);
+void co_waitgroup_wait(co_waitgroup_t *wg);
 
 #endif //COROUTINE_IN_C_COROUTINE_H
@@ -0,0 +1,377 @@
+#undef NDEBUG
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+// RTLD_NEXT needs _GNU_SOURCE, which would also turn the address parameters of accept and connect into transparent
+// unions that the definitions below could not match.
+#ifndef RTLD_NEXT
+#define RTLD_NEXT ((void *) -1l)
+#endif
+
+#define HOOK_FD_MAX (1 << 20)
+#define HOOK_POLL_CASES 64
+#define HOOK_POLL_INTERVAL_NS 1000000 // 1ms, between two polls of the descriptors that the reactor cannot wait for
+
+// How a descriptor is treated, sampled on its first use in a coroutine and forgotten when it is closed.
+enum hook_mode {
+  HOOK_UNKNOWN,
+  HOOK_COOPERATIVE, // a socket in blocking mode, made nonblocking and waited for by the reactor
+  HOOK_PASSTHROUGH, // anything else: regular files, pipes, terminals and descriptors the caller made nonblocking
+};
+
+// The events a coroutine waits for in poll, by descriptor. The reactor parks one reader and one writer per descriptor,
+// so the other coroutines that poll it for the same events meanwhile poll it every HOOK_POLL_INTERVAL_NS instead.
+enum hook_wait {
+  HOOK_WAIT_READ = 1,
+  HOOK_WAIT_WRITE = 2,
+};
+
+static uint8_t *hook_modes;
+static uint8_t *hook_waits; // right after hook_modes
+static int hook_fd_cap;
+
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_recv)(int, void *, size_t, int);
+static ssize_t (*real_send)(int, const void *, size_t, int);
+static int (*real_accept)(int, struct sockaddr *, socklen_t *);
+static int (*real_accept4)(int, struct sockaddr *, socklen_t *, int);
+static int (*real_connect)(int, const struct sockaddr *, socklen_t);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+static int (*real_usleep)(useconds_t);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static unsigned int (*real_sleep)(unsigned int);
+static int (*real_close)(int);
+
+static void *hook_resolve_(const char *name) {
+  void *f = dlsym(RTLD_NEXT, name);
+  if (f == NULL) {
+    fprintf(stderr, "libcoroutine-hook: %s is not found\n", name);
+    abort();
+  }
+  return f;
+}
+
+// Runs when the library is loaded, but another constructor may call a hook before, hence the checks in hook_init_.
+__attribute__((constructor)) static void hook_init_() {
+  if (real_close != NULL) {
+    return;
+  }
+  real_read = hook_resolve_("read");
+  real_write = hook_resolve_("write");
+  real_recv = hook_resolve_("recv");
+  real_send = hook_resolve_("send");
+  real_accept = hook_resolve_("accept");
+  real_accept4 = hook_resolve_("accept4");
+  real_connect = hook_resolve_("connect");
+  real_poll = hook_resolve_("poll");
+  real_usleep = hook_resolve_("usleep");
+  real_nanosleep = hook_resolve_("nanosleep");
+  real_sleep = hook_resolve_("sleep");
+  struct rlimit limit;
+  hook_fd_cap = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < HOOK_FD_MAX ? (int) limit.rlim_cur
+                                                                                      : HOOK_FD_MAX;
+  hook_modes = calloc(hook_fd_cap, 2);
+  if (hook_modes == NULL) {
+    hook_fd_cap = 0; // every descriptor passes through
+  }
+  hook_waits = hook_modes + hook_fd_cap;
+  __atomic_store_n(&real_close, hook_resolve_("close"), __ATOMIC_RELEASE);
+}
+
+static inline void hook_ready_() {
+  if (__builtin_expect(__atomic_load_n(&real_close, __ATOMIC_ACQUIRE) == NULL, 0)) {
+    hook_init_();
+  }
+}
+
+static inline enum hook_mode hook_mode_(int fd) {
+  return fd >= 0 && fd < hook_fd_cap ? __atomic_load_n(&hook_modes[fd], __ATOMIC_RELAXED) : HOOK_PASSTHROUGH;
+}
+
+static inline void hook_set_mode_(int fd, enum hook_mode mode) {
+  if (fd >= 0 && fd < hook_fd_cap) {
+    __atomic_store_n(&hook_modes[fd], mode, __ATOMIC_RELAXED);
+  }
+}
+
+// Pipes and terminals pass through: their file descriptions are often shared with other processes, which would see
+// them turn nonblocking.
+static bool hook_cooperative_(int fd) {
+  enum hook_mode mode = hook_mode_(fd);
+  if (mode == HOOK_UNKNOWN) {
+    struct stat st;
+    int flags = fcntl(fd, F_GETFL);
+    mode = flags >= 0 && !(flags & O_NONBLOCK) && fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode) ? HOOK_COOPERATIVE
+                                                                                               : HOOK_PASSTHROUGH;
+    hook_set_mode_(fd, mode);
+  }
+  return mode == HOOK_COOPERATIVE;
+}
+
+// Whether the calling coroutine is the one to wait for the events of wait on fd, a cooperative descriptor.
+static inline bool hook_wait_claim_(int fd, enum hook_wait wait) {
+  return !(__atomic_fetch_or(&hook_waits[fd], wait, __ATOMIC_ACQ_REL) & wait);
+}
+
+static inline void hook_wait_release_(int fd, enum hook_wait wait) {
+  __atomic_fetch_and(&hook_waits[fd], ~wait, __ATOMIC_RELEASE);
+}
+
+// Outside coroutines, the descriptors that the reactor made nonblocking block in poll, as their owner expects.
+static bool hook_block_(int fd, short events) {
+  if (errno != EAGAIN || hook_mode_(fd) != HOOK_COOPERATIVE) {
+    return false;
+  }
+  struct pollfd p = {.fd = fd, .events = events};
+  while (real_poll(&p, 1, -1) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+  hook_ready_();
+  if (co_self() != NULL && hook_cooperative_(fd)) {
+    return co_read(fd, buf, count);
+  }
+  ssize_t n;
+  while ((n = real_read(fd, buf, count)) < 0 && hook_block_(fd, POLLIN)) {
+  }
+  return n;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+  hook_ready_();
+  if (co_self() != NULL && hook_cooperative_(fd)) {
+    return co_write(fd, buf, count);
+  }
+  ssize_t n;
+  while ((n = real_write(fd, buf, count)) < 0 && hook_block_(fd, POLLOUT)) {
+  }
+  return n;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+  hook_ready_();
+  if (co_self() != NULL && !(flags & MSG_DONTWAIT) && hook_cooperative_(fd)) {
+    return co_recv(fd, buf, len, flags);
+  }
+  ssize_t n;
+  while ((n = real_recv(fd, buf, len, flags)) < 0 && !(flags & MSG_DONTWAIT) && hook_block_(fd, POLLIN)) {
+  }
+  return n;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+  hook_ready_();
+  if (co_self() != NULL && !(flags & MSG_DONTWAIT) && hook_cooperative_(fd)) {
+    return co_send(fd, buf, len, flags);
+  }
+  ssize_t n;
+  while ((n = real_send(fd, buf, len, flags)) < 0 && !(flags & MSG_DONTWAIT) && hook_block_(fd, POLLOUT)) {
+  }
+  return n;
+}
+
+// co_accept returns a nonblocking descriptor with FD_CLOEXEC: the first is kept as the reactor needs it, and the
+// connection is cooperative from the start, the second is dropped unless the caller asked for it.
+int accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+  hook_ready_();
+  if (co_self() != NULL && hook_cooperative_(fd)) {
+    int conn = co_accept(fd, addr, addrlen);
+    if (conn >= 0) {
+      hook_set_mode_(conn, flags & SOCK_NONBLOCK ? HOOK_PASSTHROUGH : HOOK_COOPERATIVE);
+      if (!(flags & SOCK_CLOEXEC)) {
+        fcntl(conn, F_SETFD, 0);
+      }
+    }
+    return conn;
+  }
+  int conn;
+  while ((conn = real_accept4(fd, addr, addrlen, flags)) < 0 && hook_block_(fd, POLLIN)) {
+  }
+  return conn;
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  return accept4(fd, addr, addrlen, 0);
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  hook_ready_();
+  if (co_self() != NULL && hook_cooperative_(fd)) {
+    return co_connect(fd, addr, addrlen);
+  }
+  if (real_connect(fd, addr, addrlen) == 0) {
+    return 0;
+  }
+  if (errno == EINPROGRESS && hook_mode_(fd) == HOOK_COOPERATIVE) {
+    errno = EAGAIN;
+    if (!hook_block_(fd, POLLOUT)) {
+      return -1;
+    }
+    int error;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+      return -1;
+    }
+    errno = error;
+    return error == 0 ? 0 : -1;
+  }
+  return -1;
+}
+
+static int hook_poll_wait_(struct pollfd *fds, nfds_t n, int64_t timeout_ns) {
+  co_select_case_t buf[HOOK_POLL_CASES];
+  co_select_case_t *cases = n * 2 <= HOOK_POLL_CASES ? buf : malloc(n * 2 * sizeof(co_select_case_t));
+  if (cases == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  int m = 0;
+  bool all = true; // whether the reactor waits for every descriptor
+  for (nfds_t i = 0; i < n; i++) {
+    if (fds[i].fd < 0) {
+      continue;
+    }
+    if (!hook_cooperative_(fds[i].fd)) {
+      all = false;
+      continue;
+    }
+    bool in = fds[i].events & (POLLIN | POLLPRI | POLLRDNORM) || !(fds[i].events & (POLLOUT | POLLWRNORM));
+    bool out = fds[i].events & (POLLOUT | POLLWRNORM);
+    // the reactor has one reader and one writer per descriptor, so a descriptor listed twice is waited for once
+    for (int j = 0; j < m; j++) {
+      if (cases[j].fd == fds[i].fd) {
+        in = in && cases[j].op != CO_SELECT_READ;
+        out = out && cases[j].op != CO_SELECT_WRITE;
+      }
+    }
+    if (in && !hook_wait_claim_(fds[i].fd, HOOK_WAIT_READ)) {
+      in = false;
+      all = false;
+    }
+    if (out && !hook_wait_claim_(fds[i].fd, HOOK_WAIT_WRITE)) {
+      out = false;
+      all = false;
+    }
+    if (in) {
+      cases[m++] = (co_select_case_t) {.op = CO_SELECT_READ, .fd = fds[i].fd};
+    }
+    if (out) {
+      cases[m++] = (co_select_case_t) {.op = CO_SELECT_WRITE, .fd = fds[i].fd};
+    }
+  }
+  if (!all && (timeout_ns < 0 || timeout_ns > HOOK_POLL_INTERVAL_NS)) {
+    timeout_ns = HOOK_POLL_INTERVAL_NS;
+  }
+  if (m > 0) {
+    co_select(cases, m, timeout_ns);
+    for (int j = 0; j < m; j++) {
+      hook_wait_release_(cases[j].fd, cases[j].op == CO_SELECT_READ ? HOOK_WAIT_READ : HOOK_WAIT_WRITE);
+    }
+  } else if (timeout_ns >= 0) {
+    co_sleep_ns(timeout_ns);
+  } else {
+    co_sleep_ns(1000000000); // nothing to wait for, forever
+  }
+  if (cases != buf) {
+    free(cases);
+  }
+  return 0;
+}
+
+static inline uint64_t hook_clock_ns_() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Polls the descriptors without blocking, and parks the coroutine on them in between until one is ready or the
+// timeout expires.
+int poll(struct pollfd *fds, nfds_t n, int timeout) {
+  hook_ready_();
+  if (co_self() == NULL || timeout == 0) {
+    return real_poll(fds, n, timeout);
+  }
+  uint64_t deadline = hook_clock_ns_() + (uint64_t) (timeout > 0 ? timeout : 0) * 1000000;
+  for (;;) {
+    int ready = real_poll(fds, n, 0);
+    if (ready != 0) {
+      return ready;
+    }
+    int64_t left = -1;
+    if (timeout > 0) {
+      uint64_t now = hook_clock_ns_();
+      if (now >= deadline) {
+        return 0;
+      }
+      left = (int64_t) (deadline - now);
+    }
+    if (hook_poll_wait_(fds, n, left) < 0) {
+      return -1;
+    }
+  }
+}
+
+int usleep(useconds_t usec) {
+  hook_ready_();
+  if (co_self() == NULL) {
+    return real_usleep(usec);
+  }
+  co_sleep_ns((uint64_t) usec * 1000);
+  return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  hook_ready_();
+  if (co_self() == NULL) {
+    return real_nanosleep(req, rem);
+  }
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  co_sleep_ns((uint64_t) req->tv_sec * 1000000000 + req->tv_nsec);
+  if (rem != NULL) {
+    rem->tv_sec = 0;
+    rem->tv_nsec = 0;
+  }
+  return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+  hook_ready_();
+  if (co_self() == NULL) {
+    return real_sleep(seconds);
+  }
+  co_sleep_ns((uint64_t) seconds * 1000000000);
+  return 0;
+}
+
+// A cooperative descriptor goes through co_close even outside coroutines, so that the reactor forgets it before its
+// number is reused. co_close only does so on a thread whose scheduler has it registered, elsewhere it is a plain
+// close.
+int close(int fd) {
+  hook_ready_();
+  enum hook_mode mode = hook_mode_(fd);
+  hook_set_mode_(fd, HOOK_UNKNOWN);
+  return mode == HOOK_COOPERATIVE ? co_close(fd) : real_close(fd);
+}
@@ -0,0 +1,168 @@
+#undef NDEBUG
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coroutine-internal.h"
+
+void inbox_init_(struct inbox *inbox) {
+  inbox->head = NULL;
+  inbox->fd = -1;
+  inbox->pushers = 0;
+}
+
+// Called by the thread of the scheduler when it exits, once nothing can push to it anymore but a pusher may still be
+// about to write fd.
+void inbox_destroy_(struct inbox *inbox) {
+  assert(__atomic_load_n(&inbox->head, __ATOMIC_ACQUIRE) == NULL);
+  while (__atomic_load_n(&inbox->pushers, __ATOMIC_ACQUIRE) > 0) {
+    sched_yield();
+  }
+  if (inbox->fd >= 0) {
+    sys_close_(inbox->fd);
+  }
+  inbox_init_(inbox);
+}
+
+void inbox_setup_(struct co_scheduler *s) {
+  struct inbox *inbox = &s->inbox;
+  if (inbox->fd >= 0) {
+    return;
+  }
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    panic("eventfd fails: %s\n", strerror(errno));
+  }
+  // level-triggered, inbox_drain_ reads it every time
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(reactor_epfd_(&s->reactor), EPOLL_CTL_ADD, fd, &event) != 0) {
+    panic("epoll_ctl for the inbox fails: %s\n", strerror(errno));
+  }
+  __atomic_store_n(&inbox->fd, fd, __ATOMIC_SEQ_CST);
+}
+
+// Any thread. node must not be touched once pushed, the scheduler may run and release it right away.
+void inbox_push_(struct co_scheduler *s, struct inbox_node *node) {
+  struct inbox *inbox = &s->inbox;
+  __atomic_add_fetch(&inbox->pushers, 1, __ATOMIC_ACQUIRE);
+  struct inbox_node *head = __atomic_load_n(&inbox->head, __ATOMIC_RELAXED);
+  do {
+    node->next = head;
+  } while (!__atomic_compare_exchange_n(&inbox->head, &head, node, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  // Loaded after the push: a scheduler that has no eventfd yet is running, and takes the node at its next switch.
+  int fd = __atomic_load_n(&inbox->fd, __ATOMIC_SEQ_CST);
+  if (head == NULL && fd >= 0) {
+    uint64_t one = 1;
+    sys_write_(fd, &one, sizeof(one)); // cannot fail short of an overflow of the counter, which is awake anyway
+  }
+  __atomic_sub_fetch(&inbox->pushers, 1, __ATOMIC_RELEASE);
+}
+
+void inbox_drain_(struct co_scheduler *s) {
+  struct inbox *inbox = &s->inbox;
+  if (inbox->fd >= 0) {
+    uint64_t count;
+    sys_read_(inbox->fd, &count, sizeof(count)); // before the exchange, a push after it writes again
+  }
+  struct inbox_node *node = __atomic_exchange_n(&inbox->head, NULL, __ATOMIC_ACQUIRE);
+  struct inbox_node *fifo = NULL;
+  while (node != NULL) {
+    struct inbox_node *next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+  }
+  while (fifo != NULL) {
+    struct inbox_node *next = fifo->next;
+    fifo->handler(s, fifo);
+    fifo = next;
+  }
+}
+
+// A co_post, with its name, freed once the coroutine is started.
+struct post_node {
+  struct inbox_node node;
+  void (*func)(void *);
+  void *arg;
+  char name[];
+};
+
+static void post_handler_(struct co_scheduler *s, struct inbox_node *node) {
+  struct post_node *post = (struct post_node *) node;
+  co_start_detached_(s, post->name, post->func, post->arg);
+  free(post);
+}
+
+int co_post(struct co_scheduler *sched, const char *name, void (*func)(void *), void *arg) {
+  if (sched->worker != NULL) {
+    return -1; // the workers of the runtime steal from each other instead
+  }
+  size_t len = name != NULL ? strlen(name) + 1 : 1;
+  struct post_node *post = malloc(sizeof(struct post_node) + len);
+  if (post == NULL) {
+    return -1;
+  }
+  post->node.handler = post_handler_;
+  post->func = func;
+  post->arg = arg;
+  memcpy(post->name, name != NULL ? name : "", len);
+  inbox_push_(sched, &post->node);
+  return 0;
+}
+
+void co_wake_(struct co_scheduler *s, struct co *co) {
+  if (co->parked) {
+    co->parked = false;
+    s->reactor.waiters--;
+    co_unblock_(s, co);
+  } else {
+    co->permit = true;
+  }
+}
+
+static void wake_handler_(struct co_scheduler *s, struct inbox_node *node) {
+  struct co *co = list_entry_(node, struct co, wake_node);
+  __atomic_store_n(&co->wake_posted, 0, __ATOMIC_RELAXED);
+  if (co->release_on_wake) {
+    co_release_(s, co); // freed meanwhile, see co_release_
+    return;
+  }
+  co_wake_(s, co);
+}
+
+void co_park() {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  if (current->runtime) {
+    runtime_park_(current, &current->permit, 0);
+    return;
+  }
+  if (current->permit) {
+    current->permit = false;
+    return;
+  }
+  inbox_setup_(s); // the wake-up may come from a thread while the scheduler sleeps
+  current->parked = true;
+  s->reactor.waiters++; // counted as a waiter, so that the scheduler sleeps on the eventfd
+  co_block_(s);
+}
+
+void co_unpark(struct co *co) {
+  assert(co != NULL);
+  if (co->runtime) {
+    runtime_unpark_(co, &co->permit);
+    return;
+  }
+  if (tls_scheduler == co->sched) {
+    co_wake_(co->sched, co);
+    return;
+  }
+  // A wake-up already in the inbox covers this one: the permit does not count.
+  int expected = 0;
+  if (__atomic_compare_exchange_n(&co->wake_posted, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    co->wake_node.handler = wake_handler_;
+    inbox_push_(co->sched, &co->wake_node);
+  }
+}
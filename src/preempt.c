@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#undef NDEBUG
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "coroutine-internal.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static pthread_once_t preempt_once = PTHREAD_ONCE_INIT;
+static struct sigaction preempt_prev_action; // the handler of PREEMPT_SIGNAL before ours, for the other signals
+
+// The signals that are not a tick of the timer of this thread go to the handler that was installed before.
+static void preempt_chain_(int sig, siginfo_t *info, void *context) {
+  if (preempt_prev_action.sa_flags & SA_SIGINFO) {
+    preempt_prev_action.sa_sigaction(sig, info, context);
+  } else if (preempt_prev_action.sa_handler != SIG_DFL && preempt_prev_action.sa_handler != SIG_IGN) {
+    preempt_prev_action.sa_handler(sig);
+  } // SIG_DFL ignores PREEMPT_SIGNAL as well
+}
+
+// Only touches the scheduler of the thread it interrupts, which is async-signal-safe. Switching right here is not: the
+// coroutine may hold a lock of malloc or stdio that the next one would take again.
+static void preempt_handler_(int sig, siginfo_t *info, void *context) {
+  struct co_scheduler *s = tls_scheduler;
+  if (s == NULL || info->si_code != SI_TIMER || info->si_value.sival_ptr != s) {
+    preempt_chain_(sig, info, context);
+    return;
+  }
+  if (!s->preempt.enabled) {
+    return; // a tick sent just before co_preempt_stop
+  }
+  unsigned long switches = s->preempt.switches;
+  if (switches == s->preempt.switches_seen) {
+    s->preempt.expired = 1;
+  }
+  s->preempt.switches_seen = switches;
+}
+
+static void preempt_install_() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = preempt_handler_;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(PREEMPT_SIGNAL, &sa, &preempt_prev_action) != 0) {
+    panic("sigaction for preemption fails: %s\n", strerror(errno));
+  }
+}
+
+// Only marks the slice of the running coroutine as expired. It is switched out at its next co_preempt_point or channel
+// operation, so a loop without a safe point is never preempted.
+int co_preempt_start(uint64_t slice_ns) {
+  if (slice_ns == 0) {
+    return -1;
+  }
+  struct co_scheduler *s = sched_();
+  pthread_once(&preempt_once, preempt_install_);
+  if (!s->preempt.enabled) {
+    // CPU time rather than wall time: a thread that sleeps in epoll_wait is not interrupted
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = PREEMPT_SIGNAL;
+    event.sigev_value.sival_ptr = s; // tells its ticks from the other signals
+    event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &s->preempt.timer) != 0) {
+      return -1;
+    }
+    s->preempt.switches_seen = s->preempt.switches;
+    s->preempt.expired = 0;
+    s->preempt.enabled = true;
+  }
+  // Every half slice, so that a coroutine is marked once it has run between half a slice and a slice. The kernel
+  // checks CPU-time timers at its tick, which rounds the period up to 1-10ms.
+  uint64_t period = slice_ns > 1 ? slice_ns / 2 : 1;
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = (time_t) (period / 1000000000);
+  spec.it_interval.tv_nsec = (long) (period % 1000000000);
+  spec.it_value = spec.it_interval;
+  if (timer_settime(s->preempt.timer, 0, &spec, NULL) != 0) {
+    preempt_destroy_(s);
+    return -1;
+  }
+  return 0;
+}
+
+void co_preempt_stop() {
+  preempt_destroy_(sched_());
+}
+
+void preempt_destroy_(struct co_scheduler *s) {
+  if (!s->preempt.enabled) {
+    return;
+  }
+  s->preempt.enabled = false;
+  timer_delete(s->preempt.timer);
+  s->preempt.expired = 0;
+}
@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#undef NDEBUG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "coroutine-internal.h"
+
+#define REACTOR_EVENT_NUM 64
+
+void reactor_init_(struct reactor *reactor) {
+  reactor->epfd = -1;
+  reactor->fds = NULL;
+  reactor->fd_cap = 0;
+  reactor->waiters = 0;
+}
+
+void reactor_destroy_(struct reactor *reactor) {
+  assert(reactor->waiters == 0);
+  if (reactor->epfd >= 0) {
+    sys_close_(reactor->epfd);
+  }
+  free(reactor->fds);
+  reactor_init_(reactor);
+}
+
+static void fd_nonblock_(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0 && !(flags & O_NONBLOCK)) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+}
+
+static struct fd_state *fd_state_(struct reactor *reactor, int fd) {
+  assert(fd >= 0);
+  if (fd >= reactor->fd_cap) {
+    int cap = reactor->fd_cap > 0 ? reactor->fd_cap : 64;
+    while (cap <= fd) {
+      cap *= 2;
+    }
+    struct fd_state *fds = realloc(reactor->fds, cap * sizeof(struct fd_state));
+    if (fds == NULL) {
+      panic("realloc for fd_state fails");
+    }
+    memset(fds + reactor->fd_cap, 0, (cap - reactor->fd_cap) * sizeof(struct fd_state));
+    reactor->fds = fds;
+    reactor->fd_cap = cap;
+  }
+  return &reactor->fds[fd];
+}
+
+int reactor_epfd_(struct reactor *reactor) {
+  if (reactor->epfd < 0) {
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd < 0) {
+      panic("epoll_create1 fails");
+    }
+  }
+  return reactor->epfd;
+}
+
+// Makes fd nonblocking and registers it the first time a coroutine of s uses it. Runtime coroutines are not tied to a
+// scheduler, they only get fd made nonblocking.
+void reactor_add_(struct co_scheduler *s, int fd) {
+  if (fd < 0) {
+    return; // the call fails with EBADF
+  }
+  if (s->current->runtime) {
+    fd_nonblock_(fd);
+    return;
+  }
+  struct reactor *reactor = &s->reactor;
+  if (fd < reactor->fd_cap && (reactor->fds[fd].registered || reactor->fds[fd].file)) {
+    return;
+  }
+  struct fd_state *state = fd_state_(reactor, fd);
+  struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+  if (epoll_ctl(reactor_epfd_(reactor), EPOLL_CTL_ADD, fd, &event) != 0 && errno != EEXIST) {
+    // e.g. a regular file, which is always ready. It stays blocking, io_uring fails operations on O_NONBLOCK files
+    // rather than waiting for the disk.
+    state->file = errno == EPERM;
+    return;
+  }
+  fd_nonblock_(fd);
+  state->registered = true;
+}
+
+static bool reactor_file_(struct co_scheduler *s, int fd) {
+  return fd >= 0 && fd < s->reactor.fd_cap && s->reactor.fds[fd].file;
+}
+
+// Parks the current coroutine until fd may be ready for reading or writing again.
+static void reactor_wait_(struct co_scheduler *s, int fd, bool write) {
+  struct co *current = s->current;
+  if (current->runtime) {
+    // the poller of the runtime wakes it up, a descriptor epoll refuses is retried at once
+    if (fd >= 0 && runtime_fd_arm_(current, fd, write)) {
+      runtime_park_(current, &current->woken, 0);
+      runtime_fd_disarm_(current, fd, write);
+    }
+    return;
+  }
+  if (fd < 0) {
+    return; // the retry fails with EBADF
+  }
+  if (fd >= s->reactor.fd_cap || !s->reactor.fds[fd].registered) {
+    reactor_add_(s, fd); // it was closed by co_close and the number reused, or its first registration failed
+    if (fd >= s->reactor.fd_cap || !s->reactor.fds[fd].registered) {
+      return;
+    }
+  }
+  struct fd_state *state = &s->reactor.fds[fd];
+  bool *ready = write ? &state->writable : &state->readable;
+  struct co **slot = write ? &state->writer : &state->reader;
+  if (*ready) {
+    *ready = false; // an edge came in since the last attempt
+    return;
+  }
+  if (*slot != NULL) {
+    panic("two coroutines waiting to %s fd %d", write ? "write" : "read", fd);
+  }
+  *slot = current;
+  *(write ? &state->writer_index : &state->reader_index) = -1;
+  s->reactor.waiters++;
+  co_block_(s);
+}
+
+static void reactor_wake_(struct co_scheduler *s, struct fd_state *state, bool write) {
+  struct co **slot = write ? &state->writer : &state->reader;
+  int index = write ? state->writer_index : state->reader_index;
+  struct co *co = *slot;
+  if (co == NULL) {
+    *(write ? &state->writable : &state->readable) = true;
+    return;
+  }
+  *slot = NULL;
+  s->reactor.waiters--;
+  if (index >= 0) {
+    select_fire_(s, co, index);
+  } else {
+    co_unblock_(s, co);
+  }
+}
+
+// Parks the coroutine in co_select on fd, which is not ready, as its case index. Negative descriptors are ignored, as by
+// poll.
+void reactor_select_add_(struct co_scheduler *s, int fd, bool write, int index) {
+  if (fd < 0) {
+    return;
+  }
+  struct fd_state *state = fd_state_(&s->reactor, fd);
+  struct co **slot = write ? &state->writer : &state->reader;
+  if (*slot != NULL) {
+    panic("two coroutines waiting to %s fd %d", write ? "write" : "read", fd);
+  }
+  *slot = s->current;
+  *(write ? &state->writer_index : &state->reader_index) = index;
+  *(write ? &state->writable : &state->readable) = false; // polled just now
+  s->reactor.waiters++;
+}
+
+void reactor_select_del_(struct co_scheduler *s, struct co *co, int fd, bool write) {
+  if (fd < 0) {
+    return;
+  }
+  struct fd_state *state = fd_state_(&s->reactor, fd);
+  struct co **slot = write ? &state->writer : &state->reader;
+  if (*slot == co) {
+    *slot = NULL;
+    s->reactor.waiters--;
+  }
+}
+
+// timeout in milliseconds as for epoll_wait
+void reactor_poll_(struct co_scheduler *s, int timeout) {
+  struct reactor *reactor = &s->reactor;
+  struct epoll_event events[REACTOR_EVENT_NUM];
+  int n = epoll_wait(reactor->epfd, events, REACTOR_EVENT_NUM, timeout);
+  if (n < 0 && errno != EINTR) {
+    panic("epoll_wait fails");
+  }
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.fd == s->uring.fd) {
+      uring_flush_(s); // completions came in
+      continue;
+    }
+    if (events[i].data.fd == s->inbox.fd) {
+      inbox_drain_(s);
+      continue;
+    }
+    struct fd_state *state = &reactor->fds[events[i].data.fd];
+    uint32_t e = events[i].events;
+    if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      reactor_wake_(s, state, false);
+    }
+    if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      reactor_wake_(s, state, true);
+    }
+  }
+}
+
+ssize_t co_read(int fd, void *buf, size_t count) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  ssize_t n;
+  if (reactor_file_(s, fd) && uring_rw_(s, false, fd, buf, count, -1, &n)) {
+    return n;
+  }
+  for (;;) {
+    n = sys_read_(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, false);
+    }
+  }
+}
+
+ssize_t co_write(int fd, const void *buf, size_t count) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  ssize_t n;
+  if (reactor_file_(s, fd) && uring_rw_(s, true, fd, (void *) buf, count, -1, &n)) {
+    return n;
+  }
+  for (;;) {
+    n = sys_write_(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, true);
+    }
+  }
+}
+
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  ssize_t n;
+  if (reactor_file_(s, fd) && uring_rw_(s, false, fd, buf, count, offset, &n)) {
+    return n;
+  }
+  for (;;) {
+    n = pread(fd, buf, count, offset);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, false);
+    }
+  }
+}
+
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  ssize_t n;
+  if (reactor_file_(s, fd) && uring_rw_(s, true, fd, (void *) buf, count, offset, &n)) {
+    return n;
+  }
+  for (;;) {
+    n = pwrite(fd, buf, count, offset);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, true);
+    }
+  }
+}
+
+ssize_t co_recv(int fd, void *buf, size_t len, int flags) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  for (;;) {
+    ssize_t n = sys_recv_(fd, buf, len, flags);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, false);
+    }
+  }
+}
+
+ssize_t co_send(int fd, const void *buf, size_t len, int flags) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  for (;;) {
+    ssize_t n = sys_send_(fd, buf, len, flags | MSG_NOSIGNAL);
+    if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+      return n;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, true);
+    }
+  }
+}
+
+int co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  for (;;) {
+    int conn = sys_accept4_(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn >= 0 || (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)) {
+      return conn;
+    }
+    if (errno == EAGAIN) {
+      reactor_wait_(s, fd, false);
+    }
+  }
+}
+
+int co_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  struct co_scheduler *s = sched_();
+  reactor_add_(s, fd);
+  if (sys_connect_(fd, addr, addrlen) == 0) {
+    return 0;
+  }
+  if (errno != EINPROGRESS && errno != EINTR) {
+    return -1;
+  }
+  // The connection completes in the background, fd becomes writable once it is done either way.
+  for (;;) {
+    reactor_wait_(s, fd, true);
+    int error;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+      return -1;
+    }
+    if (error != 0) {
+      errno = error;
+      return -1;
+    }
+    struct sockaddr_storage peer;
+    len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *) &peer, &len) == 0) {
+      return 0;
+    }
+    if (errno != ENOTCONN) {
+      return -1;
+    }
+  }
+}
+
+// Only the reactor of the calling thread may have fd registered, a thread without a scheduler just closes it.
+int co_close(int fd) {
+  struct co_scheduler *s = tls_scheduler;
+  if (s == NULL) {
+    return sys_close_(fd);
+  }
+  struct reactor *reactor = &s->reactor;
+  if (fd >= 0 && fd < reactor->fd_cap && reactor->fds[fd].registered) {
+    struct fd_state *state = &reactor->fds[fd];
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+    // the parked coroutines retry and fail with EBADF
+    reactor_wake_(s, state, false);
+    reactor_wake_(s, state, true);
+    memset(state, 0, sizeof(struct fd_state));
+  } else if (fd >= 0 && fd < reactor->fd_cap) {
+    reactor->fds[fd].file = false;
+  }
+  return sys_close_(fd);
+}
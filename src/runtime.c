@@ -0,0 +1,680 @@
+#undef NDEBUG
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "coroutine-internal.h"
+
+#define DEQUE_INITIAL_SIZE 256
+#define WORKER_SPIN_ROUNDS 64
+#define POLLER_EVENTS 64
+
+// park_state of a runtime coroutine. An unpark that finds it PARK_NONE, because it runs or is still switching out to
+// park, leaves PARK_NOTIFIED so that its worker puts it back on the deque instead of parking it.
+enum {
+  PARK_NONE,
+  PARK_PARKED,
+  PARK_NOTIFIED
+};
+
+// Chase-Lev deque. The owner pushes at bottom, everybody takes at top with a CAS, so a worker runs its own coroutines
+// in FIFO order like run_queue does. A full array is replaced by one twice as large, the old one is kept in retired
+// until co_runtime_stop because a thief may still be reading it.
+struct deque_array {
+  long size; // power of 2
+  struct deque_array *retired;
+  struct co *buf[];
+};
+
+struct deque {
+  long top __attribute__((aligned(CACHE_LINE_SIZE)));
+  long bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+  struct deque_array *array;
+};
+
+struct worker {
+  struct deque deque;
+  struct deque_array *retired;
+  pthread_t thread;
+  unsigned int seed; // for picking victims
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+bool runtime_running;
+static bool runtime_stopping;
+static struct worker *workers;
+static int worker_num;
+static long runtime_live; // runtime coroutines that have not died yet
+
+// runtime_mutex protects inject and is held by the threads going to sleep on idle_cond or dead_cond.
+static pthread_mutex_t runtime_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dead_cond = PTHREAD_COND_INITIALIZER;
+static struct list inject; // coroutines started by threads outside the runtime
+static int sleepers;       // workers waiting on idle_cond
+static int blocked;        // threads outside the runtime waiting on dead_cond
+
+// The runtime coroutines parked on a descriptor.
+struct poll_fd {
+  struct co *reader;
+  struct co *writer;
+};
+
+// The workers have no reactor or timing wheel of their own, the poller thread wakes the parked runtime coroutines up
+// instead: at their deadline on poll_wheel, and when their descriptor is ready on poll_epfd, where it is registered
+// one-shot for each wait. poll_mutex protects the variables below but poll_epfd and poll_eventfd.
+static pthread_mutex_t poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t poller;
+static int poll_epfd;
+static int poll_eventfd;    // makes the poller look at poll_wheel again, for an earlier deadline or to stop
+static uint64_t poll_until; // when the poller wakes up by itself, UINT64_MAX without timers
+static bool poll_stopping;
+static struct timer_wheel poll_wheel;
+static struct poll_fd *poll_fds; // indexed by descriptor
+static int poll_fd_cap;
+
+static struct deque_array *deque_array_new_(long size) {
+  struct deque_array *a = malloc(sizeof(struct deque_array) + size * sizeof(struct co *));
+  if (a == NULL) {
+    panic("malloc for deque_array fails");
+  }
+  a->size = size;
+  a->retired = NULL;
+  return a;
+}
+
+static void deque_init_(struct deque *d) {
+  d->top = 0;
+  d->bottom = 0;
+  d->array = deque_array_new_(DEQUE_INITIAL_SIZE);
+}
+
+static void deque_push_(struct worker *w, struct co *co) {
+  struct deque *d = &w->deque;
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  struct deque_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  if (b - t > a->size - 1) {
+    struct deque_array *grown = deque_array_new_(a->size * 2);
+    for (long i = t; i < b; i++) {
+      grown->buf[i & (grown->size - 1)] = __atomic_load_n(&a->buf[i & (a->size - 1)], __ATOMIC_RELAXED);
+    }
+    a->retired = w->retired;
+    w->retired = a;
+    __atomic_store_n(&d->array, grown, __ATOMIC_RELEASE);
+    a = grown;
+  }
+  __atomic_store_n(&a->buf[b & (a->size - 1)], co, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// Returns NULL if d is empty. A lost race is retried only by the owner, a thief moves on to the next victim.
+static struct co *deque_take_(struct deque *d, bool owner) {
+  for (;;) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+      return NULL;
+    }
+    struct deque_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    struct co *co = __atomic_load_n(&a->buf[t & (a->size - 1)], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return co;
+    }
+    if (!owner) {
+      return NULL;
+    }
+  }
+}
+
+static bool deque_empty_(struct deque *d) {
+  return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+static inline void co_lock_(struct co *co) {
+  while (__atomic_exchange_n(&co->lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&co->lock, __ATOMIC_RELAXED)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void co_unlock_(struct co *co) {
+  __atomic_store_n(&co->lock, 0, __ATOMIC_RELEASE);
+}
+
+static bool co_dead_(struct co *co) {
+  co_lock_(co);
+  bool dead = co->status == CO_DEAD;
+  co_unlock_(co);
+  return dead;
+}
+
+// Wakes up a sleeping worker for work that has just been published. Pairs with the increment of sleepers in
+// worker_sleep_: either the worker sees the work or we see the worker.
+static void runtime_notify_() {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleepers, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&runtime_mutex);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&runtime_mutex);
+  }
+}
+
+// Makes co runnable again: on the deque of the calling worker, or through inject from a thread outside the runtime.
+static void runtime_ready_(struct co *co) {
+  struct co_scheduler *s = tls_scheduler;
+  if (s != NULL && s->worker != NULL) {
+    deque_push_(s->worker, co);
+    runtime_notify_();
+  } else {
+    pthread_mutex_lock(&runtime_mutex);
+    list_push_back_(&inject, co);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&runtime_mutex);
+  }
+}
+
+// Sets *flag and claims co if it is parked, which the caller then makes runnable again.
+static bool runtime_wake_(struct co *co, bool *flag) {
+  co_lock_(co);
+  *flag = true;
+  bool parked = __atomic_exchange_n(&co->park_state, PARK_NOTIFIED, __ATOMIC_ACQ_REL) == PARK_PARKED;
+  if (parked) {
+    __atomic_store_n(&co->park_state, PARK_NONE, __ATOMIC_RELAXED);
+  }
+  co_unlock_(co);
+  return parked;
+}
+
+static bool runtime_has_work_() {
+  if (__atomic_load_n(&inject.len, __ATOMIC_RELAXED) > 0) {
+    return true;
+  }
+  for (int i = 0; i < worker_num; i++) {
+    if (!deque_empty_(&workers[i].deque)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static struct co *worker_find_(struct worker *w) {
+  struct co *co = deque_take_(&w->deque, true);
+  if (co != NULL) {
+    return co;
+  }
+  if (__atomic_load_n(&inject.len, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&runtime_mutex);
+    if (inject.len > 0) {
+      co = list_front_(&inject);
+      list_erase_(&inject, co);
+    }
+    pthread_mutex_unlock(&runtime_mutex);
+    if (co != NULL) {
+      return co;
+    }
+  }
+  int start = rand_r(&w->seed) % worker_num;
+  for (int i = 0; i < worker_num; i++) {
+    struct worker *victim = &workers[(start + i) % worker_num];
+    if (victim != w && (co = deque_take_(&victim->deque, false)) != NULL) {
+      return co;
+    }
+  }
+  return NULL;
+}
+
+// Returns false once the runtime is stopping.
+static bool worker_sleep_() {
+  pthread_mutex_lock(&runtime_mutex);
+  __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+  if (!runtime_stopping && !runtime_has_work_()) {
+    pthread_cond_wait(&idle_cond, &runtime_mutex);
+  }
+  __atomic_sub_fetch(&sleepers, 1, __ATOMIC_RELAXED);
+  bool stopping = runtime_stopping;
+  pthread_mutex_unlock(&runtime_mutex);
+  return !stopping;
+}
+
+static void worker_exit_(struct co_scheduler *s, struct worker *w, struct co *co) {
+  stack_free_(&s->stack_pool, co->stack, co->stack_kind, co->stack_size);
+  co->stack = NULL;
+  // Under the lock of co, since a waiter of co_wait_timeout takes itself off the list when it times out.
+  co_lock_(co);
+  co->status = CO_DEAD;
+  bool woken = !list_head_empty_(&co->waiters);
+  for (struct list_head *node = co->waiters.next; node != &co->waiters;) {
+    struct co *waiter = list_entry_(node, struct co, wait_link);
+    node = node->next; // the waiter may run on another worker as soon as it is pushed
+    list_head_init_(&waiter->wait_link);
+    if (waiter->status == CO_WAITING) {
+      waiter->status = CO_RUNNING;
+      deque_push_(w, waiter);
+    } else if (runtime_wake_(waiter, &waiter->woken)) {
+      deque_push_(w, waiter);
+    }
+  }
+  list_head_init_(&co->waiters);
+  co_unlock_(co);
+  if (woken) {
+    runtime_notify_();
+  }
+  // pairs with the increment of blocked in runtime_wait_
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bool wake = __atomic_load_n(&blocked, __ATOMIC_RELAXED) > 0;
+  wake |= __atomic_sub_fetch(&runtime_live, 1, __ATOMIC_ACQ_REL) == 0;
+  __atomic_store_n(&co->released, true, __ATOMIC_RELEASE); // co may be freed from now on
+  if (wake) {
+    pthread_mutex_lock(&runtime_mutex);
+    pthread_cond_broadcast(&dead_cond);
+    pthread_mutex_unlock(&runtime_mutex);
+  }
+}
+
+// Runs co until it switches back with runtime_switch_out_, then carries out what it asked for. This has to happen
+// here rather than on the coroutine's stack, because another worker may pick co up as soon as it is published.
+static void worker_run_(struct co_scheduler *s, struct worker *w, struct co *co) {
+  co->sched = s;
+  if (co->status == CO_NEW) {
+    trace_start_(s, co); // spawned without a scheduler
+    co->stack = stack_alloc_(&s->stack_pool, co->stack_kind, co->stack_size);
+    context_make_(&co->context, co->stack + co->stack_size, co_wrapper_, co);
+    co_lock_(co);
+    co->status = CO_RUNNING;
+    co_unlock_(co);
+  }
+  s->current = co;
+  preempt_switch_(s);
+  stats_switch_(s, s->main, co, false, NULL);
+  trace_reason_(s, TRACE_RESUME);
+  trace_switch_(s, s->main, co);
+  context_switch_(&s->main->context, &co->context);
+  s->current = s->main;
+  bool parked = s->runtime_action == RUNTIME_WAIT || s->runtime_action == RUNTIME_PARK;
+  stats_switch_(s, co, s->main, parked, context_sp_(&co->context));
+  trace_reason_(s, s->runtime_action == RUNTIME_YIELD ? TRACE_YIELD : parked ? TRACE_WAIT : TRACE_EXIT);
+  trace_switch_(s, co, s->main);
+  switch (s->runtime_action) {
+    case RUNTIME_YIELD:
+      deque_push_(w, co);
+      break;
+    case RUNTIME_WAIT: {
+      struct co *target = s->runtime_target;
+      co_lock_(target);
+      if (target->status == CO_DEAD) {
+        co_unlock_(target);
+        deque_push_(w, co);
+      } else {
+        co->status = CO_WAITING;
+        list_head_add_tail_(&target->waiters, &co->wait_link);
+        co_unlock_(target);
+      }
+      break;
+    }
+    case RUNTIME_PARK: {
+      int expected = PARK_NONE;
+      if (!__atomic_compare_exchange_n(&co->park_state, &expected, PARK_PARKED, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&co->park_state, PARK_NONE, __ATOMIC_RELAXED); // unparked while switching out
+        deque_push_(w, co);
+      }
+      break;
+    }
+    case RUNTIME_EXIT:
+      worker_exit_(s, w, co);
+      break;
+  }
+}
+
+// Called with poll_mutex held. Registers fd for the waits of p, until its next event.
+static int poll_fd_ctl_(int fd, struct poll_fd *p) {
+  struct epoll_event event = {
+    .events = EPOLLONESHOT | (p->reader != NULL ? EPOLLIN | EPOLLRDHUP : 0) | (p->writer != NULL ? EPOLLOUT : 0),
+    .data.fd = fd
+  };
+  if (epoll_ctl(poll_epfd, EPOLL_CTL_MOD, fd, &event) == 0) {
+    return 0;
+  }
+  return errno == ENOENT ? epoll_ctl(poll_epfd, EPOLL_CTL_ADD, fd, &event) : -1;
+}
+
+// Called with poll_mutex held. Unparks the waits of fd that events end, or all of them if fd cannot be registered
+// again, so that they retry and fail.
+static void poll_fd_fire_(int fd, uint32_t events) {
+  if (fd >= poll_fd_cap) {
+    return;
+  }
+  struct poll_fd *p = &poll_fds[fd];
+  struct co *reader = events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP) ? p->reader : NULL;
+  struct co *writer = events & (EPOLLOUT | EPOLLERR | EPOLLHUP) ? p->writer : NULL;
+  if (reader != NULL) {
+    p->reader = NULL;
+    runtime_unpark_(reader, &reader->woken);
+  }
+  if (writer != NULL) {
+    p->writer = NULL;
+    runtime_unpark_(writer, &writer->woken);
+  }
+  if ((p->reader != NULL || p->writer != NULL) && poll_fd_ctl_(fd, p) != 0) {
+    poll_fd_fire_(fd, EPOLLERR);
+  }
+}
+
+static void *poller_main_(void *arg) {
+  struct epoll_event events[POLLER_EVENTS];
+  for (;;) {
+    pthread_mutex_lock(&poll_mutex);
+    int timeout = timer_wheel_advance_(NULL, &poll_wheel);
+    poll_until = timeout < 0 ? UINT64_MAX : clock_ns_() + (uint64_t) timeout * 1000000;
+    bool stopping = poll_stopping;
+    pthread_mutex_unlock(&poll_mutex);
+    if (stopping) {
+      break;
+    }
+    int n = epoll_wait(poll_epfd, events, POLLER_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+      panic("epoll_wait fails: %s\n", strerror(errno));
+    }
+    pthread_mutex_lock(&poll_mutex);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == poll_eventfd) {
+        uint64_t count;
+        sys_read_(poll_eventfd, &count, sizeof(count));
+      } else {
+        poll_fd_fire_(events[i].data.fd, events[i].events);
+      }
+    }
+    pthread_mutex_unlock(&poll_mutex);
+  }
+  return NULL;
+}
+
+static void poller_wake_() {
+  uint64_t one = 1;
+  sys_write_(poll_eventfd, &one, sizeof(one));
+}
+
+static void poller_start_() {
+  poll_epfd = epoll_create1(EPOLL_CLOEXEC);
+  poll_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (poll_epfd < 0 || poll_eventfd < 0) {
+    panic("epoll_create1 or eventfd for the runtime poller fails: %s\n", strerror(errno));
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = poll_eventfd};
+  if (epoll_ctl(poll_epfd, EPOLL_CTL_ADD, poll_eventfd, &event) != 0) {
+    panic("epoll_ctl for the runtime poller fails: %s\n", strerror(errno));
+  }
+  timer_wheel_init_(&poll_wheel);
+  poll_until = UINT64_MAX;
+  poll_stopping = false;
+  if (pthread_create(&poller, NULL, poller_main_, NULL) != 0) {
+    panic("pthread_create for the runtime poller fails");
+  }
+}
+
+// Once every runtime coroutine has died, so that no timer is armed and no descriptor waited for.
+static void poller_stop_() {
+  pthread_mutex_lock(&poll_mutex);
+  poll_stopping = true;
+  pthread_mutex_unlock(&poll_mutex);
+  poller_wake_();
+  pthread_join(poller, NULL);
+  sys_close_(poll_epfd);
+  sys_close_(poll_eventfd);
+  free(poll_fds);
+  poll_fds = NULL;
+  poll_fd_cap = 0;
+}
+
+static void *worker_main_(void *arg) {
+  struct worker *w = arg;
+  struct co_scheduler *s = sched_();
+  s->worker = w;
+  int idle = 0;
+  for (;;) {
+    struct co *co = worker_find_(w);
+    if (co != NULL) {
+      worker_run_(s, w, co);
+      idle = 0;
+    } else if (++idle < WORKER_SPIN_ROUNDS) {
+      sched_yield();
+    } else if (!worker_sleep_()) {
+      break;
+    } else {
+      idle = 0;
+    }
+  }
+  s->worker = NULL;
+  return NULL;
+}
+
+void co_runtime_start(int worker_count) {
+  if (runtime_running) {
+    panic("the runtime is already running");
+  }
+  if (worker_count <= 0) {
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  workers = aligned_alloc(CACHE_LINE_SIZE, worker_count * sizeof(struct worker));
+  if (workers == NULL) {
+    panic("aligned_alloc for workers fails");
+  }
+  worker_num = worker_count;
+  runtime_stopping = false;
+  list_init_(&inject);
+  for (int i = 0; i < worker_num; i++) {
+    deque_init_(&workers[i].deque);
+    workers[i].retired = NULL;
+    workers[i].seed = i + 1;
+  }
+  poller_start_();
+  __atomic_store_n(&runtime_running, true, __ATOMIC_RELEASE);
+  for (int i = 0; i < worker_num; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main_, &workers[i]) != 0) {
+      panic("pthread_create for worker fails");
+    }
+  }
+}
+
+void co_runtime_stop() {
+  if (!runtime_running) {
+    return;
+  }
+  pthread_mutex_lock(&runtime_mutex);
+  while (__atomic_load_n(&runtime_live, __ATOMIC_ACQUIRE) > 0) {
+    pthread_cond_wait(&dead_cond, &runtime_mutex);
+  }
+  __atomic_store_n(&runtime_running, false, __ATOMIC_RELEASE);
+  runtime_stopping = true;
+  pthread_cond_broadcast(&idle_cond);
+  pthread_mutex_unlock(&runtime_mutex);
+  for (int i = 0; i < worker_num; i++) {
+    pthread_join(workers[i].thread, NULL);
+    free(workers[i].deque.array);
+    while (workers[i].retired != NULL) {
+      struct deque_array *a = workers[i].retired;
+      workers[i].retired = a->retired;
+      free(a);
+    }
+  }
+  free(workers);
+  workers = NULL;
+  worker_num = 0;
+  poller_stop_();
+}
+
+struct co *runtime_spawn_(const char *name, void (*func)(void *), void *arg, const co_attr_t *attr) {
+  if (attr != NULL && attr->stack_kind == CO_STACK_SHARED) {
+    panic("CO_STACK_SHARED is not supported by the runtime"); // shared stacks are per thread
+  }
+  // not from the slab of the calling thread: the coroutine may be freed by any thread
+  struct co *co = aligned_alloc(CACHE_LINE_SIZE, CO_SLOT_SIZE);
+  if (co == NULL) {
+    panic("aligned_alloc for co fails");
+  }
+  co_init_(NULL, co, name, func, arg, attr);
+  co->runtime = true;
+  __atomic_add_fetch(&runtime_live, 1, __ATOMIC_RELAXED);
+  runtime_ready_(co);
+  return co;
+}
+
+void runtime_switch_out_(struct co_scheduler *s, struct co *co, enum runtime_action action, struct co *target) {
+  s->runtime_action = action;
+  s->runtime_target = target;
+  context_switch_(&co->context, &s->main->context);
+  // may be on another worker now, s must not be touched anymore
+}
+
+void runtime_wait_(struct co_scheduler *s, struct co *current, struct co *co) {
+  if (current->runtime) {
+    runtime_switch_out_(s, current, RUNTIME_WAIT, co);
+    return;
+  }
+  // A thread outside the runtime has nothing to run meanwhile, so it blocks until co dies.
+  pthread_mutex_lock(&runtime_mutex);
+  __atomic_add_fetch(&blocked, 1, __ATOMIC_SEQ_CST);
+  while (!co_dead_(co)) {
+    pthread_cond_wait(&dead_cond, &runtime_mutex);
+  }
+  __atomic_sub_fetch(&blocked, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&runtime_mutex);
+}
+
+// Returns false if co is still alive at deadline.
+bool runtime_wait_timeout_(struct co *current, struct co *co, uint64_t deadline) {
+  if (current->runtime) {
+    co_lock_(co);
+    if (co->status == CO_DEAD) {
+      co_unlock_(co);
+      return true;
+    }
+    list_head_add_tail_(&co->waiters, &current->wait_link); // unparked by the worker co dies on
+    co_unlock_(co);
+    while (!co_dead_(co) && runtime_park_(current, &current->woken, deadline)) {}
+    co_lock_(co);
+    list_head_del_(&current->wait_link); // self-linked if taken off by the worker
+    list_head_init_(&current->wait_link);
+    bool dead = co->status == CO_DEAD;
+    co_unlock_(co);
+    return dead;
+  }
+  uint64_t now = clock_ns_();
+  struct timespec abstime;
+  clock_gettime(CLOCK_REALTIME, &abstime); // the clock of dead_cond
+  uint64_t ns = abstime.tv_nsec + (deadline > now ? deadline - now : 0);
+  abstime.tv_sec += ns / 1000000000;
+  abstime.tv_nsec = ns % 1000000000;
+  pthread_mutex_lock(&runtime_mutex);
+  __atomic_add_fetch(&blocked, 1, __ATOMIC_SEQ_CST);
+  bool dead;
+  while (!(dead = co_dead_(co)) && pthread_cond_timedwait(&dead_cond, &runtime_mutex, &abstime) == 0) {}
+  if (!dead) {
+    dead = co_dead_(co);
+  }
+  __atomic_sub_fetch(&blocked, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&runtime_mutex);
+  return dead;
+}
+
+// Takes co off the run queue until runtime_unpark_ sets *flag, then clears it, or until deadline if it is not 0. flag
+// is read under the lock of co, so that the unparker is done with co once co sees it set, and co may die right after.
+// Returns false at the deadline.
+bool runtime_park_(struct co *co, bool *flag, uint64_t deadline) {
+  if (deadline != 0) {
+    uint64_t now = clock_ns_();
+    pthread_mutex_lock(&poll_mutex);
+    timer_add_(&poll_wheel, co, deadline > now ? deadline - now : 0);
+    if (deadline < poll_until) {
+      poll_until = deadline;
+      poller_wake_();
+    }
+    pthread_mutex_unlock(&poll_mutex);
+  }
+  bool set;
+  for (;;) {
+    co_lock_(co);
+    set = flag != NULL && *flag;
+    if (set) {
+      *flag = false;
+    }
+    bool timed_out = co->timed_out;
+    co_unlock_(co);
+    if (set || timed_out) {
+      break;
+    }
+    runtime_switch_out_(tls_scheduler, co, RUNTIME_PARK, NULL); // resumed by runtime_unpark_, maybe on another worker
+  }
+  if (deadline != 0) {
+    pthread_mutex_lock(&poll_mutex);
+    timer_cancel_(&poll_wheel, co);
+    pthread_mutex_unlock(&poll_mutex);
+    co->timed_out = false; // the poller no longer touches co
+  }
+  return set;
+}
+
+// Sets *flag and, if co is parked, makes it runnable again. The caller must know co is not freed meanwhile.
+void runtime_unpark_(struct co *co, bool *flag) {
+  if (runtime_wake_(co, flag)) {
+    runtime_ready_(co); // nobody else can resume it, so it cannot die meanwhile
+  }
+}
+
+// Parks co in the slot of fd until fd is ready to read or write, with runtime_park_ on woken. Returns false if fd
+// cannot be waited for, e.g. a regular file or a closed descriptor, which the caller retries at once.
+bool runtime_fd_arm_(struct co *co, int fd, bool write) {
+  pthread_mutex_lock(&poll_mutex);
+  if (fd >= poll_fd_cap) {
+    int cap = poll_fd_cap > 0 ? poll_fd_cap : 64;
+    while (cap <= fd) {
+      cap *= 2;
+    }
+    struct poll_fd *fds = realloc(poll_fds, cap * sizeof(struct poll_fd));
+    if (fds == NULL) {
+      panic("realloc for poll_fds fails");
+    }
+    memset(fds + poll_fd_cap, 0, (cap - poll_fd_cap) * sizeof(struct poll_fd));
+    poll_fds = fds;
+    poll_fd_cap = cap;
+  }
+  struct poll_fd *p = &poll_fds[fd];
+  struct co **slot = write ? &p->writer : &p->reader;
+  if (*slot != NULL && *slot != co) {
+    panic("two coroutines waiting to %s fd %d", write ? "write" : "read", fd);
+  }
+  *slot = co;
+  bool armed = poll_fd_ctl_(fd, p) == 0;
+  if (!armed) {
+    *slot = NULL;
+  }
+  pthread_mutex_unlock(&poll_mutex);
+  return armed;
+}
+
+// Takes co out of the slot of fd, if the poller has not yet.
+void runtime_fd_disarm_(struct co *co, int fd, bool write) {
+  pthread_mutex_lock(&poll_mutex);
+  struct co **slot = write ? &poll_fds[fd].writer : &poll_fds[fd].reader;
+  if (*slot == co) {
+    *slot = NULL;
+  }
+  pthread_mutex_unlock(&poll_mutex);
+}
+
+void runtime_free_(struct co *co) {
+  assert(co->status == CO_DEAD);
+  while (!__atomic_load_n(&co->released, __ATOMIC_ACQUIRE)) {
+    sched_yield(); // the worker it died on is still waking up its waiters
+  }
+  if (co->name != co->inline_name) {
+    free(co->name);
+  }
+  free(co);
+}
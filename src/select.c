@@ -0,0 +1,145 @@
+#undef NDEBUG
+
+#include <poll.h>
+
+#include "coroutine-internal.h"
+
+// The wait of a coroutine in co_select, on its stack. The coroutine is registered on the queue of every channel case
+// with a chan_waiter, in the reader or writer slot of every descriptor case, and on the timing wheel for the timeout.
+struct select_state {
+  co_select_case_t *cases;
+  int n;
+  int fired;                  // the case that woke it up, -1 for the timeout
+  struct chan_waiter *waiters; // linked by next
+};
+
+static inline bool select_chan_case_(const co_select_case_t *c) {
+  return c->op == CO_SELECT_SEND || c->op == CO_SELECT_RECV;
+}
+
+// Wakes co up for its case index, after taking it off every other case at once, so that nothing else can complete one
+// of them meanwhile.
+void select_fire_(struct co_scheduler *s, struct co *co, int index) {
+  struct select_state *state = co_addr_(co, co->select);
+  co->select = NULL;
+  state->fired = index;
+  for (struct chan_waiter *w = state->waiters; w != NULL; w = w->next) {
+    list_head_del_(&w->link);
+    list_head_init_(&w->link);
+  }
+  co_select_case_t *cases = co_addr_(co, state->cases);
+  for (int i = 0; i < state->n; i++) {
+    if (!select_chan_case_(&cases[i])) {
+      reactor_select_del_(s, co, cases[i].fd, cases[i].op == CO_SELECT_WRITE);
+    }
+  }
+  timer_cancel_(&s->timer_wheel, co);
+  co_unblock_(s, co);
+}
+
+// The workers of the runtime have no reactor, so a runtime coroutine is parked on all the descriptors at once for the
+// poller of the runtime, until one may be ready or the deadline, and polls them again. Channels are per scheduler, a
+// runtime coroutine cannot wait on them.
+static int select_runtime_(struct co *current, co_select_case_t *cases, int n, int64_t timeout_ns) {
+  struct pollfd pollfds[n > 0 ? n : 1];
+  for (int i = 0; i < n; i++) {
+    if (select_chan_case_(&cases[i])) {
+      panic("co_select on channels is not supported by runtime coroutines");
+    }
+    pollfds[i].fd = cases[i].fd;
+    pollfds[i].events = cases[i].op == CO_SELECT_WRITE ? POLLOUT : POLLIN;
+  }
+  uint64_t deadline = timeout_ns > 0 ? clock_ns_() + timeout_ns : 0;
+  for (;;) {
+    if (n > 0 && sys_poll_(pollfds, n, 0) < 0) {
+      panic("poll fails");
+    }
+    for (int i = 0; i < n; i++) {
+      if (pollfds[i].revents != 0) {
+        return i;
+      }
+    }
+    if (timeout_ns == 0 || (timeout_ns > 0 && clock_ns_() >= deadline)) {
+      return -1;
+    }
+    int armed = 0;
+    while (armed < n && (cases[armed].fd < 0 || runtime_fd_arm_(current, cases[armed].fd,
+                                                                cases[armed].op == CO_SELECT_WRITE))) {
+      armed++;
+    }
+    if (armed == n) { // otherwise a descriptor epoll refuses, which poll reports ready
+      runtime_park_(current, &current->woken, deadline);
+    }
+    while (armed-- > 0) {
+      if (cases[armed].fd >= 0) {
+        runtime_fd_disarm_(current, cases[armed].fd, cases[armed].op == CO_SELECT_WRITE);
+      }
+    }
+  }
+}
+
+int co_select(co_select_case_t *cases, int n, int64_t timeout_ns) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (current->runtime) {
+    return select_runtime_(current, cases, n, timeout_ns);
+  }
+  // The first case that is ready now, in order.
+  int fds = 0;
+  for (int i = 0; i < n; i++) {
+    if (select_chan_case_(&cases[i])) {
+      chan_sched_(cases[i].chan);
+    } else {
+      reactor_add_(s, cases[i].fd);
+      fds++;
+    }
+  }
+  struct pollfd pollfds[fds > 0 ? fds : 1];
+  for (int i = 0, j = 0; i < n; i++) {
+    if (!select_chan_case_(&cases[i])) {
+      pollfds[j].fd = cases[i].fd;
+      pollfds[j++].events = cases[i].op == CO_SELECT_WRITE ? POLLOUT : POLLIN;
+    }
+  }
+  if (fds > 0 && sys_poll_(pollfds, fds, 0) < 0) {
+    panic("poll fails");
+  }
+  for (int i = 0, j = 0; i < n; i++) {
+    if (select_chan_case_(&cases[i])) {
+      if (chan_try_(s, cases[i].chan, cases[i].op == CO_SELECT_SEND, cases[i].elem, &cases[i].ok)) {
+        return i;
+      }
+    } else if (pollfds[j++].revents != 0) {
+      return i;
+    }
+  }
+  if (timeout_ns == 0) {
+    return -1;
+  }
+  // Then wait for all of them at once.
+  struct select_state state = {cases, n, -1, NULL};
+  for (int i = 0; i < n; i++) {
+    if (select_chan_case_(&cases[i])) {
+      struct chan_waiter *w = chan_enqueue_(s, cases[i].chan, cases[i].op == CO_SELECT_SEND, cases[i].elem, 1, 0, i);
+      w->next = state.waiters;
+      state.waiters = w;
+    } else {
+      reactor_select_add_(s, cases[i].fd, cases[i].op == CO_SELECT_WRITE, i);
+    }
+  }
+  current->select = &state;
+  if (timeout_ns > 0) {
+    timer_add_(&s->timer_wheel, current, timeout_ns);
+  }
+  co_block_(s);
+  while (state.waiters != NULL) {
+    struct chan_waiter *w = state.waiters;
+    state.waiters = w->next;
+    if (w->index == state.fired) {
+      cases[w->index].ok = w->done == 1 ? 0 : -1;
+    }
+    chan_waiter_put_(s, w);
+  }
+  return state.fired;
+}
@@ -0,0 +1,56 @@
+#undef NDEBUG
+
+#include "coroutine-internal.h"
+
+#ifdef COROUTINE_STATS
+int co_stats(struct co *co, struct co_stats *stats) {
+  *stats = co->stats;
+  struct co_scheduler *s = sched_();
+  if (co == s->current) {
+    // the run of the caller so far
+    stats->run_cycles += stats_cycles_() - co->stats_at;
+  }
+  return 0;
+}
+
+int co_scheduler_stats(struct co_scheduler_stats *stats) {
+  struct co_scheduler *s = sched_();
+  struct scheduler_stats *st = &s->stats;
+  uint64_t now = clock_ns_();
+  uint64_t window = st->switches - st->window_switches;
+  stats->switches = st->switches;
+  stats->uptime_ns = now - st->base_ns;
+  stats->cycles_per_sec = stats->uptime_ns > 0
+                          ? (uint64_t) ((double) (stats_cycles_() - st->base_cycles) * 1e9 / stats->uptime_ns) : 0;
+  stats->switches_per_sec = now > st->window_ns ? (double) window * 1e9 / (now - st->window_ns) : 0;
+  stats->ready_len = ready_len_(s);
+  stats->waiting_len = s->waiting_list.len;
+  stats->ready_len_avg = window > 0 ? (double) st->ready_len_sum / window : stats->ready_len;
+  stats->waiting_len_avg = window > 0 ? (double) st->waiting_len_sum / window : s->waiting_list.len;
+  stats->ready_len_max = st->ready_len_max > stats->ready_len ? st->ready_len_max : stats->ready_len;
+  stats->waiting_len_max = st->waiting_len_max > s->waiting_list.len ? st->waiting_len_max : s->waiting_list.len;
+  stats->started = st->started;
+  stats->live = ready_len_(s) + s->waiting_list.len + s->dead_list.len - 1; // main is not counted
+  stats->stack_maps = s->stack_pool.misses;
+  stats->heap_allocs = st->heap_allocs;
+  stats->preemptions = st->preemptions;
+  stats->slabs = s->co_arena.slabs;
+  st->window_ns = now;
+  st->window_switches = st->switches;
+  st->ready_len_sum = 0;
+  st->waiting_len_sum = 0;
+  st->ready_len_max = 0;
+  st->waiting_len_max = 0;
+  return 0;
+}
+#else
+int co_stats(struct co *co, struct co_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  return -1;
+}
+
+int co_scheduler_stats(struct co_scheduler_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  return -1;
+}
+#endif
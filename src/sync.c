@@ -0,0 +1,219 @@
+#undef NDEBUG
+
+#include "coroutine-internal.h"
+
+// The coroutines parked on a primitive are linked by their wait_link, oldest first, and woken up in that order. A
+// wakeup hands the mutex or a unit of the semaphore over to the coroutine woken up, so that nobody can overtake it.
+struct co_mutex {
+  struct co_scheduler *sched;
+  struct co *owner; // NULL when unlocked
+  struct list_head waiters;
+};
+
+struct co_cond {
+  struct co_scheduler *sched;
+  struct co_mutex *mutex; // the mutex of the waiters
+  struct list_head waiters;
+};
+
+struct co_sem {
+  struct co_scheduler *sched;
+  unsigned int value;
+  struct list_head waiters;
+};
+
+struct co_waitgroup {
+  struct co_scheduler *sched;
+  int count;
+  struct list_head waiters;
+};
+
+static void *sync_new_(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    panic("malloc for a synchronization primitive fails");
+  }
+  return p;
+}
+
+static struct co_scheduler *sync_sched_(struct co_scheduler *owner) {
+  struct co_scheduler *s = sched_();
+  if (s != owner || s->current->runtime) {
+    panic("a synchronization primitive is only for the coroutines of the scheduler that created it");
+  }
+  return s;
+}
+
+static void sync_park_(struct co_scheduler *s, struct list_head *waiters) {
+  list_head_add_tail_(waiters, &s->current->wait_link);
+  co_block_(s);
+}
+
+static struct co *sync_wake_(struct co_scheduler *s, struct list_head *waiters) {
+  struct co *co = list_entry_(waiters->next, struct co, wait_link);
+  list_head_del_(&co->wait_link);
+  list_head_init_(&co->wait_link);
+  co_unblock_(s, co);
+  return co;
+}
+
+struct co_mutex *co_mutex_new() {
+  struct co_mutex *m = sync_new_(sizeof(struct co_mutex));
+  m->sched = sched_();
+  m->owner = NULL;
+  list_head_init_(&m->waiters);
+  return m;
+}
+
+void co_mutex_free(struct co_mutex *m) {
+  assert(m->owner == NULL);
+  free(m);
+}
+
+void co_mutex_lock(struct co_mutex *m) {
+  struct co_scheduler *s = sync_sched_(m->sched);
+  if (m->owner == NULL) {
+    m->owner = s->current;
+    return;
+  }
+  assert(m->owner != s->current);
+  sync_park_(s, &m->waiters); // owner once woken up
+}
+
+int co_mutex_trylock(struct co_mutex *m) {
+  struct co_scheduler *s = sync_sched_(m->sched);
+  if (m->owner != NULL) {
+    return -1;
+  }
+  m->owner = s->current;
+  return 0;
+}
+
+void co_mutex_unlock(struct co_mutex *m) {
+  struct co_scheduler *s = sync_sched_(m->sched);
+  assert(m->owner == s->current);
+  m->owner = list_head_empty_(&m->waiters) ? NULL : sync_wake_(s, &m->waiters);
+}
+
+struct co_cond *co_cond_new() {
+  struct co_cond *c = sync_new_(sizeof(struct co_cond));
+  c->sched = sched_();
+  c->mutex = NULL;
+  list_head_init_(&c->waiters);
+  return c;
+}
+
+void co_cond_free(struct co_cond *c) {
+  assert(list_head_empty_(&c->waiters));
+  free(c);
+}
+
+void co_cond_wait(struct co_cond *c, struct co_mutex *m) {
+  struct co_scheduler *s = sync_sched_(c->sched);
+  assert(c->mutex == NULL || c->mutex == m);
+  c->mutex = m;
+  co_mutex_unlock(m);
+  sync_park_(s, &c->waiters); // owns m once woken up
+}
+
+// Gives the mutex to the first waiter of c if it is free, otherwise moves the waiter to the queue of the mutex, so that
+// it is not woken up only to park again.
+static void co_cond_wake_(struct co_scheduler *s, struct co_cond *c) {
+  struct co_mutex *m = c->mutex;
+  if (m->owner == NULL) {
+    m->owner = sync_wake_(s, &c->waiters);
+  } else {
+    struct co *co = list_entry_(c->waiters.next, struct co, wait_link);
+    list_head_del_(&co->wait_link);
+    list_head_add_tail_(&m->waiters, &co->wait_link);
+  }
+}
+
+void co_cond_signal(struct co_cond *c) {
+  struct co_scheduler *s = sync_sched_(c->sched);
+  if (!list_head_empty_(&c->waiters)) {
+    co_cond_wake_(s, c);
+  }
+}
+
+void co_cond_broadcast(struct co_cond *c) {
+  struct co_scheduler *s = sync_sched_(c->sched);
+  while (!list_head_empty_(&c->waiters)) {
+    co_cond_wake_(s, c);
+  }
+}
+
+struct co_sem *co_sem_new(unsigned int value) {
+  struct co_sem *sem = sync_new_(sizeof(struct co_sem));
+  sem->sched = sched_();
+  sem->value = value;
+  list_head_init_(&sem->waiters);
+  return sem;
+}
+
+void co_sem_free(struct co_sem *sem) {
+  assert(list_head_empty_(&sem->waiters));
+  free(sem);
+}
+
+void co_sem_wait(struct co_sem *sem) {
+  struct co_scheduler *s = sync_sched_(sem->sched);
+  if (sem->value > 0) {
+    sem->value--;
+    return;
+  }
+  sync_park_(s, &sem->waiters); // the unit is handed over by co_sem_post
+}
+
+int co_sem_trywait(struct co_sem *sem) {
+  sync_sched_(sem->sched);
+  if (sem->value == 0) {
+    return -1;
+  }
+  sem->value--;
+  return 0;
+}
+
+void co_sem_post(struct co_sem *sem) {
+  struct co_scheduler *s = sync_sched_(sem->sched);
+  if (list_head_empty_(&sem->waiters)) {
+    sem->value++;
+  } else {
+    sync_wake_(s, &sem->waiters);
+  }
+}
+
+struct co_waitgroup *co_waitgroup_new() {
+  struct co_waitgroup *wg = sync_new_(sizeof(struct co_waitgroup));
+  wg->sched = sched_();
+  wg->count = 0;
+  list_head_init_(&wg->waiters);
+  return wg;
+}
+
+void co_waitgroup_free(struct co_waitgroup *wg) {
+  assert(list_head_empty_(&wg->waiters));
+  free(wg);
+}
+
+void co_waitgroup_add(struct co_waitgroup *wg, int n) {
+  struct co_scheduler *s = sync_sched_(wg->sched);
+  wg->count += n;
+  if (wg->count < 0) {
+    panic("negative co_waitgroup counter");
+  }
+  while (wg->count == 0 && !list_head_empty_(&wg->waiters)) {
+    sync_wake_(s, &wg->waiters);
+  }
+}
+
+void co_waitgroup_done(struct co_waitgroup *wg) {
+  co_waitgroup_add(wg, -1);
+}
+
+void co_waitgroup_wait(struct co_waitgroup *wg) {
+  struct co_scheduler *s = sync_sched_(wg->sched);
+  if (wg->count > 0) {
+    sync_park_(s, &wg->waiters);
+  }
+}
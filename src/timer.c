@@ -0,0 +1,181 @@
+#undef NDEBUG
+
+#include "coroutine-internal.h"
+
+#define TIMER_MAX_TICKS ((uint64_t) 1 << (TIMER_LEVEL_BITS * TIMER_LEVEL_NUM - 1)) // longer timers are re-armed
+
+void timer_wheel_init_(struct timer_wheel *w) {
+  w->base = clock_ns_();
+  w->now = 0;
+  w->count = 0;
+  for (int l = 0; l < TIMER_LEVEL_NUM; l++) {
+    w->occupied[l] = 0;
+    for (int i = 0; i < TIMER_LEVEL_SIZE; i++) {
+      list_head_init_(&w->slots[l][i]);
+    }
+  }
+}
+
+static inline int timer_index_(uint64_t tick, int level) {
+  return (tick >> (level * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1);
+}
+
+// Puts co in the slot of the lowest level whose span around now covers its expiry.
+static void timer_insert_(struct timer_wheel *w, struct co *co) {
+  uint64_t at = co->timer_expire;
+  if (at > w->now + TIMER_MAX_TICKS) {
+    at = w->now + TIMER_MAX_TICKS;
+  }
+  int level = 0;
+  while (level < TIMER_LEVEL_NUM - 1 &&
+         (at >> ((level + 1) * TIMER_LEVEL_BITS)) != (w->now >> ((level + 1) * TIMER_LEVEL_BITS))) {
+    level++;
+  }
+  int index = timer_index_(at, level);
+  list_head_add_tail_(&w->slots[level][index], &co->timer_link);
+  w->occupied[level] |= (uint64_t) 1 << index;
+}
+
+void timer_add_(struct timer_wheel *w, struct co *co, uint64_t ns) {
+  uint64_t expire = (clock_ns_() - w->base + ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+  co->timer_expire = expire > w->now ? expire : w->now + 1;
+  co->timed_out = false;
+  timer_insert_(w, co);
+  w->count++;
+}
+
+void timer_cancel_(struct timer_wheel *w, struct co *co) {
+  struct list_head *node = &co->timer_link;
+  if (list_head_empty_(node)) {
+    return;
+  }
+  list_head_del_(node);
+  if (node->next == node->prev) {
+    // node->next is the head of the slot, which is now empty
+    size_t slot = (struct list_head *) node->next - &w->slots[0][0];
+    w->occupied[slot / TIMER_LEVEL_SIZE] &= ~((uint64_t) 1 << (slot % TIMER_LEVEL_SIZE));
+  }
+  list_head_init_(node);
+  w->count--;
+}
+
+static void timer_expire_(struct co_scheduler *s, struct timer_wheel *w, struct co *co) {
+  w->count--;
+  list_head_init_(&co->timer_link);
+  if (co->runtime) {
+    runtime_unpark_(co, &co->timed_out); // on the wheel of the runtime poller, in runtime_park_
+    return;
+  }
+  if (co->select != NULL) {
+    select_fire_(s, co, -1);
+    return;
+  }
+  list_head_del_(&co->wait_link); // co_wait_timeout leaves the waiters of its target
+  list_head_init_(&co->wait_link);
+  co->timed_out = true;
+  co_unblock_(s, co);
+}
+
+// Processes tick t: moves the timers of the slots of the levels whose span starts at t down, from the highest level so
+// that timers moved into a lower slot starting at t are moved again, then expires the timers of t.
+static void timer_tick_(struct co_scheduler *s, struct timer_wheel *w, uint64_t t) {
+  w->now = t;
+  int level = 0;
+  while (level < TIMER_LEVEL_NUM - 1 && timer_index_(t, level) == 0) {
+    level++;
+  }
+  for (; level >= 0; level--) {
+    int index = timer_index_(t, level);
+    if (!(w->occupied[level] & ((uint64_t) 1 << index))) {
+      continue;
+    }
+    w->occupied[level] &= ~((uint64_t) 1 << index);
+    struct list_head slot;
+    list_head_splice_init_(&w->slots[level][index], &slot);
+    while (!list_head_empty_(&slot)) {
+      struct co *co = list_entry_(slot.next, struct co, timer_link);
+      list_head_del_(&co->timer_link);
+      if (level == 0 && co->timer_expire <= t) {
+        timer_expire_(s, w, co);
+      } else {
+        timer_insert_(w, co);
+      }
+    }
+  }
+}
+
+// The next tick after now with a non-empty slot to process, only called with armed timers.
+static uint64_t timer_next_(struct timer_wheel *w) {
+  for (int level = 0; level < TIMER_LEVEL_NUM; level++) {
+    if (w->occupied[level] == 0) {
+      continue;
+    }
+    int shift = level * TIMER_LEVEL_BITS;
+    int current = timer_index_(w->now, level);
+    uint64_t later = current == TIMER_LEVEL_SIZE - 1 ? 0 : w->occupied[level] & (~(uint64_t) 0 << (current + 1));
+    uint64_t span = (uint64_t) 1 << (shift + TIMER_LEVEL_BITS);
+    uint64_t start = w->now & ~(span - 1);
+    if (later == 0) {
+      // only the top level wraps around, its slots before now belong to the next round
+      start += span;
+      later = w->occupied[level];
+    }
+    return start + ((uint64_t) __builtin_ctzll(later) << shift);
+  }
+  assert(false);
+}
+
+// Expires the timers of w due by now, which is the wheel of s, or the one of the runtime poller with s NULL. Returns
+// the number of milliseconds until the next tick with timers to process, or -1 if there is no timer.
+int timer_wheel_advance_(struct co_scheduler *s, struct timer_wheel *w) {
+  if (w->count == 0) {
+    return -1;
+  }
+  uint64_t elapsed = clock_ns_() - w->base;
+  uint64_t target = elapsed / TIMER_TICK_NS;
+  uint64_t next;
+  while (w->count > 0 && (next = timer_next_(w)) <= target) {
+    timer_tick_(s, w, next);
+  }
+  if (w->now < target) {
+    w->now = target;
+  }
+  if (w->count == 0) {
+    return -1;
+  }
+  uint64_t wait = next * TIMER_TICK_NS - elapsed;
+  return (int) ((wait + 999999) / 1000000);
+}
+
+void co_sleep_ns(uint64_t ns) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (ns == 0) {
+    co_yield();
+    return;
+  }
+  if (current->runtime) {
+    runtime_park_(current, NULL, clock_ns_() + ns);
+    return;
+  }
+  timer_add_(&s->timer_wheel, current, ns);
+  co_block_(s);
+}
+
+int co_wait_timeout(struct co *co, uint64_t ns) {
+  struct co_scheduler *s = sched_();
+  struct co *current = s->current;
+  assert(current->status == CO_NEW || current->status == CO_RUNNING);
+  if (co->runtime) {
+    return runtime_wait_timeout_(current, co, clock_ns_() + ns) ? 0 : -1;
+  }
+  assert(co->sched == s);
+  if (co->status == CO_DEAD) {
+    return 0;
+  }
+  timer_add_(&s->timer_wheel, current, ns);
+  list_head_add_tail_(&co->waiters, &current->wait_link);
+  co_block_(s);
+  return current->timed_out ? -1 : 0;
+}
@@ -0,0 +1,123 @@
+#undef NDEBUG
+
+#include <unistd.h>
+
+#include "coroutine-internal.h"
+
+#ifdef COROUTINE_TRACE
+uint32_t trace_next_id;
+
+static const char *const trace_type_names[] = {"start", "yield", "wait", "block", "resume", "transfer", "exit",
+                                               "preempt"};
+
+static void trace_start_list_(struct co_scheduler *s, struct list *list) {
+  for (struct list_head *node = list->head.next; node != &list->head; node = node->next) {
+    trace_start_(s, list_entry_(node, struct co, link));
+  }
+}
+
+int co_trace_start(size_t events) {
+  struct co_scheduler *s = sched_();
+  size_t cap = 64;
+  while (cap < events) {
+    cap <<= 1;
+  }
+  struct trace_event *buf = malloc(cap * sizeof(struct trace_event));
+  if (buf == NULL) {
+    panic("malloc for the trace ring fails");
+  }
+  free(s->trace.events);
+  s->trace.events = buf;
+  s->trace.mask = cap - 1;
+  s->trace.head = 0;
+  // name the coroutines started before
+  for (int level = 0; level < CO_PRIORITY_NUM; level++) {
+    struct run_ring *r = &s->run_queue.levels[level];
+    for (uint32_t i = r->head; i != r->tail; i++) {
+      if (r->slots[i & r->mask] != NULL) {
+        trace_start_(s, r->slots[i & r->mask]);
+      }
+    }
+  }
+  trace_start_(s, s->current);
+  trace_start_list_(s, &s->waiting_list);
+  trace_record_(s, TRACE_RESUME, 0, s->current->trace_id, NULL); // the run of the caller from now on
+  return 0;
+}
+
+void co_trace_stop() {
+  trace_destroy_(sched_());
+}
+
+void trace_destroy_(struct co_scheduler *s) {
+  free(s->trace.events);
+  s->trace.events = NULL;
+}
+
+// Names come from the callers of co_start, only the characters that need no escaping are kept.
+static void trace_name_(FILE *f, const char *name) {
+  for (int i = 0; i < TRACE_NAME_SIZE && name[i] != '\0'; i++) {
+    fputc(name[i] == '"' || name[i] == '\\' || (unsigned char) name[i] < 0x20 ? '_' : name[i], f);
+  }
+}
+
+// Writes one complete event per run of a coroutine, from the switch to it until the next switch, which tells why it
+// was switched out.
+int co_trace_export(const char *path) {
+  struct co_scheduler *s = sched_();
+  struct trace_ring *ring = &s->trace;
+  if (ring->events == NULL) {
+    return -1;
+  }
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  uint64_t end = ring->head;
+  uint64_t begin = end > ring->mask + 1 ? end - (ring->mask + 1) : 0;
+  uint64_t base = end > begin ? ring->events[begin & ring->mask].ts : 0;
+  int pid = getpid();
+  const char *sep = "";
+  struct trace_event *run = NULL; // the last switch
+  fprintf(f, "{\"traceEvents\": [\n");
+  for (uint64_t i = begin; i < end; i++) {
+    struct trace_event *e = &ring->events[i & ring->mask];
+    if (e->type == TRACE_START) {
+      fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"",
+              sep, pid, e->to);
+      trace_name_(f, e->name);
+      fprintf(f, "\"}}");
+      sep = ",\n";
+      continue;
+    }
+    if (run != NULL) {
+      fprintf(f, "%s{\"name\": \"run\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                 "\"args\": {\"out\": \"%s\"}}", sep, pid, run->to, (run->ts - base) / 1e3, (e->ts - run->ts) / 1e3,
+              trace_type_names[e->type]);
+      sep = ",\n";
+    }
+    run = e;
+  }
+  if (run != NULL) {
+    fprintf(f, "%s{\"name\": \"run\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+               "\"args\": {\"out\": \"running\"}}", sep, pid, run->to, (run->ts - base) / 1e3,
+            (clock_ns_() - run->ts) / 1e3);
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0 ? 0 : -1;
+}
+#else
+int co_trace_start(size_t events) {
+  return -1;
+}
+
+void co_trace_stop() {
+}
+
+int co_trace_export(const char *path) {
+  return -1;
+}
+
+void trace_destroy_(struct co_scheduler *s) {
+}
+#endif
@@ -0,0 +1,209 @@
+#undef NDEBUG
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "coroutine-internal.h"
+
+#ifdef COROUTINE_IO_URING
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_MAX_LEN (1u << 30) // per operation, the length of an SQE is 32-bit
+
+void uring_init_(struct uring *u) {
+  memset(u, 0, sizeof(struct uring));
+  u->fd = -1;
+}
+
+static void uring_unmap_(struct uring *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->cq_map != NULL && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) {
+    munmap(u->cq_map, u->cq_map_size);
+  }
+  if (u->sq_map != NULL && u->sq_map != MAP_FAILED) {
+    munmap(u->sq_map, u->sq_map_size);
+  }
+}
+
+void uring_destroy_(struct uring *u) {
+  assert(u->inflight == 0);
+  if (u->fd >= 0) {
+    uring_unmap_(u);
+    sys_close_(u->fd);
+  }
+  uring_init_(u);
+}
+
+// Sets up the rings, or disables io_uring for s if the kernel does not have it or does not allow it.
+static bool uring_setup_(struct co_scheduler *s) {
+  struct uring *u = &s->uring;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0) {
+    u->disabled = true;
+    return false;
+  }
+  u->fd = fd;
+  u->features = p.features;
+  u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->sq_map_size = u->cq_map_size = u->sq_map_size > u->cq_map_size ? u->sq_map_size : u->cq_map_size;
+  }
+  u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  u->cq_map = p.features & IORING_FEAT_SINGLE_MMAP
+              ? u->sq_map
+              : mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED ||
+      epoll_ctl(reactor_epfd_(&s->reactor), EPOLL_CTL_ADD, fd, &event) != 0) {
+    uring_destroy_(u);
+    u->disabled = true;
+    return false;
+  }
+  uint8_t *sq = u->sq_map;
+  uint8_t *cq = u->cq_map;
+  u->sq_head = (uint32_t *) (sq + p.sq_off.head);
+  u->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+  u->sq_array = (uint32_t *) (sq + p.sq_off.array);
+  u->sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->cq_head = (uint32_t *) (cq + p.cq_off.head);
+  u->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+  u->cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+  u->cq_entries = p.cq_entries;
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return true;
+}
+
+// Submits the queued SQEs. Without SQPOLL the kernel consumes them all during the call, unless the CQ ring overflows,
+// in which case the rest are retried at the next flush.
+static void uring_submit_(struct uring *u) {
+  while (u->pending > 0) {
+    int n = (int) syscall(__NR_io_uring_enter, u->fd, u->pending, 0, 0, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EBUSY) {
+        return;
+      }
+      panic("io_uring_enter fails: %s\n", strerror(errno));
+    }
+    u->pending -= n;
+  }
+}
+
+static void uring_reap_(struct co_scheduler *s) {
+  struct uring *u = &s->uring;
+  uint32_t head = *u->cq_head;
+  uint32_t tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    struct co *co = (struct co *) (uintptr_t) cqe->user_data;
+    co->io_result = cqe->res;
+    u->inflight--;
+    s->reactor.waiters--;
+    co_unblock_(s, co);
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_flush_(struct co_scheduler *s) {
+  if (s->uring.inflight > 0) {
+    uring_submit_(&s->uring);
+    uring_reap_(s);
+  }
+}
+
+// Reads or writes fd at offset, or at its file position if offset is -1, through io_uring: queues the operation and
+// parks the current coroutine until it completes. Returns false if the caller has to make the syscall itself: runtime
+// coroutines have no scheduler to wake them, and the kernel could write into a shared stack while another coroutine
+// runs on it.
+bool uring_rw_(struct co_scheduler *s, bool write, int fd, void *buf, size_t count, off_t offset, ssize_t *n) {
+  struct uring *u = &s->uring;
+  struct co *current = s->current;
+  if (u->disabled || current->runtime || current->stack_kind == CO_STACK_SHARED) {
+    return false;
+  }
+  if (u->fd < 0 && !uring_setup_(s)) {
+    return false;
+  }
+  if (u->inflight == u->cq_entries || (offset < 0 && !(u->features & IORING_FEAT_RW_CUR_POS))) {
+    return false;
+  }
+  uint32_t tail = *u->sq_tail;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+    uring_submit_(u);
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+      return false;
+    }
+  }
+  uint32_t index = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = count < URING_MAX_LEN ? count : URING_MAX_LEN;
+  sqe->off = (uint64_t) offset;
+  sqe->user_data = (uintptr_t) current;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->pending++;
+  u->inflight++;
+  s->reactor.waiters++;
+  co_block_(s);
+  if (current->io_result < 0) {
+    errno = -current->io_result;
+    *n = -1;
+  } else {
+    *n = current->io_result;
+  }
+  return true;
+}
+
+int co_io_uring(int enable) {
+  struct co_scheduler *s = sched_();
+  struct uring *u = &s->uring;
+  if (!enable) {
+    u->disabled = true;
+    return 0;
+  }
+  if (u->fd >= 0) {
+    u->disabled = false;
+    return 0;
+  }
+  u->disabled = false;
+  return uring_setup_(s) ? 0 : -1;
+}
+#else
+void uring_init_(struct uring *u) {
+  memset(u, 0, sizeof(struct uring));
+  u->fd = -1;
+  u->disabled = true;
+}
+
+void uring_destroy_(struct uring *u) {
+}
+
+bool uring_rw_(struct co_scheduler *s, bool write, int fd, void *buf, size_t count, off_t offset, ssize_t *n) {
+  return false;
+}
+
+void uring_flush_(struct co_scheduler *s) {
+}
+
+int co_io_uring(int enable) {
+  return enable ? -1 : 0;
+}
+#endif
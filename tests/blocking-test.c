@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+enum { CALLS = 8 };
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Stands for getaddrinfo, fsync and the like: blocks the thread it runs on.
+static void *slow_square(void *arg) {
+  usleep(20000);
+  long n = (long) arg;
+  return (void *) (n * n);
+}
+
+static double cpu_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int ticks;
+
+static void ticker(void *arg) {
+  double end = now_ms() + 30;
+  while (now_ms() < end) {
+    ticks++;
+    co_sleep_ns(1000000);
+  }
+}
+
+static void caller(void *arg) {
+  long n = *(long *) arg;
+  *(long *) arg = (long) co_run_blocking(slow_square, (void *) n);
+}
+
+static void run(long *results, int n, const co_attr_t *attr) {
+  coroutine_t *cos[CALLS];
+  for (int i = 0; i < n; i++) {
+    results[i] = i;
+    cos[i] = co_start_ex("caller", caller, &results[i], attr);
+  }
+  for (int i = 0; i < n; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    assert(results[i] == (long) i * i);
+  }
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  long results[CALLS];
+
+  printf("Test #1. Expect: 4 calls of 20ms overlap on the pool while the ticker runs\n");
+  double start = now_ms();
+  coroutine_t *tick = co_start("ticker", ticker, NULL);
+  run(results, 4, NULL);
+  double elapsed = now_ms() - start;
+  co_wait(tick);
+  co_free(tick);
+  printf("%s, ticker %s\n", elapsed < 60 ? "overlapped" : "serialized", ticks >= 5 ? "ran" : "starved");
+  assert(elapsed >= 20 && elapsed < 60 && ticks >= 5);
+
+  printf("Test #2. Expect: the main flow and shared-stack coroutines get their results\n");
+  long square = (long) co_run_blocking(slow_square, (void *) 7L);
+  assert(square == 49);
+  co_attr_t shared = {.stack_kind = CO_STACK_SHARED};
+  run(results, CALLS, &shared);
+  printf("ok\n");
+
+  printf("Test #3. Expect: 1 thread and a queue of 2 serialize %d calls\n", CALLS);
+  struct co_blocking_pool_stats before, after;
+  co_blocking_pool_get_stats(&before);
+  co_blocking_pool_config(1, 2);
+  start = now_ms();
+  run(results, CALLS, NULL);
+  elapsed = now_ms() - start;
+  co_blocking_pool_get_stats(&after);
+  printf("%lu calls, %s\n", after.completed - before.completed, after.full_waits > before.full_waits ? "waited" : "");
+  assert(after.completed - before.completed == CALLS && after.submitted == after.completed);
+  // counted once per call that waited
+  assert(after.full_waits > before.full_waits && after.full_waits - before.full_waits <= CALLS);
+  assert(elapsed >= CALLS * 20);
+  assert(after.queued == 0 && after.running == 0 && after.latency_ns_max >= after.wait_ns_max);
+
+  printf("Test #4. Expect: runtime coroutines get their results, and their workers idle meanwhile\n");
+  co_blocking_pool_config(4, 1024);
+  co_runtime_start(2);
+  double cpu = cpu_ms();
+  run(results, CALLS, NULL);
+  cpu = cpu_ms() - cpu;
+  co_runtime_stop();
+  printf("%.1fms of CPU\n", cpu);
+  assert(cpu < 20);
+  return 0;
+}
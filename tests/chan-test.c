@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+enum { N = 1000, BATCH = 7 };
+
+static int trace[8];
+static int traced;
+
+static void ping(void *arg) {
+  co_chan_t *chan = arg;
+  for (int i = 0; i < 3; i++) {
+    trace[traced++] = i;
+    co_chan_send(chan, &i);
+  }
+}
+
+static void pong(void *arg) {
+  co_chan_t *chan = arg;
+  int v;
+  while (co_chan_recv(chan, &v) == 0) {
+    trace[traced++] = 10 + v;
+  }
+}
+
+static long received;
+
+static void receiver(void *arg) {
+  co_chan_t *chan = arg;
+  int buf[BATCH];
+  size_t n;
+  while ((n = co_chan_recv_n(chan, buf, BATCH)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      received += buf[i];
+    }
+  }
+}
+
+static void sender(void *arg) {
+  co_chan_t *chan = arg;
+  int buf[N];
+  for (int i = 0; i < N; i++) {
+    buf[i] = i;
+  }
+  size_t sent = co_chan_send_n(chan, buf, N);
+  assert(sent == N);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  // a send to an unbuffered channel returns once a receiver has the value
+  printf("Test #1. Expect: 0 10 1 2 11 12\n");
+  co_chan_t *chan = co_chan_new(sizeof(int), 0);
+  coroutine_t *co1 = co_start("ping", ping, chan);
+  coroutine_t *co2 = co_start("pong", pong, chan);
+  co_wait(co1);
+  co_chan_close(chan);
+  co_wait(co2);
+  co_free(co1);
+  co_free(co2);
+  co_chan_free(chan);
+  for (int i = 0; i < traced; i++) {
+    printf("%d ", trace[i]);
+  }
+  printf("\n");
+  assert(traced == 6 && trace[1] == 10 && trace[3] == 2 && trace[4] == 11 && trace[5] == 12);
+
+  co_attr_t attrs[2] = {{0}, {.stack_kind = CO_STACK_SHARED}};
+  for (int a = 0; a < 2; a++) {
+    printf("Test #%d. Expect: %d\n", 2 + a, 2 * N * (N - 1) / 2);
+    received = 0;
+    chan = co_chan_new(sizeof(int), 16);
+    // the senders park with most of their batch, the receivers take it from their stacks
+    coroutine_t *cos[4];
+    cos[0] = co_start_ex("sender", sender, chan, &attrs[a]);
+    cos[1] = co_start_ex("sender", sender, chan, &attrs[a]);
+    cos[2] = co_start_ex("receiver", receiver, chan, &attrs[a]);
+    cos[3] = co_start_ex("receiver", receiver, chan, &attrs[a]);
+    co_wait(cos[0]);
+    co_wait(cos[1]);
+    co_chan_close(chan);
+    co_wait(cos[2]);
+    co_wait(cos[3]);
+    for (int i = 0; i < 4; i++) {
+      co_free(cos[i]);
+    }
+    co_chan_free(chan);
+    assert(received == 2L * N * (N - 1) / 2);
+    printf("%ld\n", received);
+  }
+
+  printf("Test #4. Expect: 0 -1\n");
+  chan = co_chan_new(sizeof(int), 1);
+  int v = 42;
+  co_chan_send(chan, &v);
+  co_chan_close(chan);
+  int r1 = co_chan_recv(chan, &v);
+  int r2 = co_chan_recv(chan, &v);
+  co_chan_free(chan);
+  assert(r1 == 0 && v == 42 && r2 == -1);
+  printf("%d %d\n", r1, r2);
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "coroutine.h"
+
+static void counter(void *arg) {
+  for (intptr_t i = 0; i < (intptr_t) arg; i++) {
+    co_yield_value((void *) i);
+  }
+}
+
+// A stage of a pipeline: doubles the values of the generator it reads from.
+static void doubler(void *arg) {
+  void *v;
+  while (co_gen_next(arg, &v) == 0) {
+    co_yield_value((void *) ((intptr_t) v * 2));
+  }
+}
+
+static int trace[8];
+static int traced;
+static coroutine_t *ping_co, *pong_co;
+
+static void ping(void *arg) {
+  (void) arg;
+  for (int i = 0; i < 3; i++) {
+    trace[traced++] = i;
+    co_transfer(pong_co);
+  }
+}
+
+static void pong(void *arg) {
+  (void) arg;
+  for (int i = 0; i < 3; i++) {
+    trace[traced++] = 10 + i;
+    co_transfer(ping_co);
+  }
+}
+
+static char order[8];
+static int ordered;
+static coroutine_t *second_co;
+
+static void first(void *arg) {
+  order[ordered++] = 'a';
+  co_transfer(second_co);
+  order[ordered++] = 'A';
+}
+
+static void second(void *arg) {
+  order[ordered++] = 'b'; // dies without handing control back
+}
+
+static void third(void *arg) {
+  order[ordered++] = 'c';
+}
+
+static int idled;
+
+static void idle(void *arg) {
+  (void) arg;
+  for (int i = 0; i < 10; i++) {
+    idled++;
+    co_yield();
+  }
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: 0 1 2 3 4\n");
+  coroutine_t *gen = co_start("counter", counter, (void *) 5);
+  void *v;
+  while (co_gen_next(gen, &v) == 0) {
+    printf("%d ", (int) (intptr_t) v);
+  }
+  printf("\n");
+  int r = co_gen_next(gen, &v);
+  assert(r == -1);
+  co_free(gen);
+
+  // other ready coroutines do not run between the stages, whose values go straight through
+  printf("Test #2. Expect: 0 2 4 6\n");
+  coroutine_t *other = co_start("idle", idle, NULL);
+  co_attr_t attr = {.stack_kind = CO_STACK_SHARED};
+  gen = co_start_ex("counter", counter, (void *) 4, &attr);
+  coroutine_t *stage = co_start_ex("doubler", doubler, gen, &attr);
+  intptr_t sum = 0;
+  while (co_gen_next(stage, &v) == 0) {
+    printf("%d ", (int) (intptr_t) v);
+    sum += (intptr_t) v;
+  }
+  printf("\n");
+  assert(sum == 12 && idled == 0);
+  co_free(stage);
+  co_free(gen);
+  co_wait(other);
+  co_free(other);
+
+  // the coroutines hand the CPU to each other without going back to main in between
+  printf("Test #3. Expect: 0 10 1 11 2 12\n");
+  ping_co = co_start("ping", ping, NULL);
+  pong_co = co_start("pong", pong, NULL);
+  co_wait(ping_co);
+  for (int i = 0; i < traced; i++) {
+    printf("%d ", trace[i]);
+  }
+  printf("\n");
+  assert(traced == 6 && trace[1] == 10 && trace[4] == 2 && trace[5] == 12);
+  co_resume(pong_co); // parked in its last transfer, to a coroutine that died since
+  co_wait(pong_co);
+  co_free(ping_co);
+  co_free(pong_co);
+
+  // the caller of co_transfer is not ready until it is handed control back
+  printf("Test #4. Expect: abcA\n");
+  coroutine_t *first_co = co_start("first", first, NULL);
+  second_co = co_start("second", second, NULL);
+  coroutine_t *third_co = co_start("third", third, NULL);
+  co_wait(third_co);
+  co_resume(first_co);
+  printf("%s\n", order);
+  assert(strcmp(order, "abcA") == 0);
+  co_wait(first_co);
+  co_free(first_co);
+  co_free(second_co);
+  co_free(third_co);
+  return 0;
+}
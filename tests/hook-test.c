@@ -0,0 +1,237 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+// The test links libcoroutine-hook, so the plain calls below are the hooked ones, as in a library that knows nothing
+// about coroutines.
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int pair[2];
+static int ticks;
+
+static void blocking_reader(void *arg) {
+  char c;
+  ssize_t n = read(pair[0], &c, 1);
+  assert(n == 1);
+  *(int *) arg = ticks;
+}
+
+static void ticker(void *arg) {
+  for (int i = 0; i < 3; i++) {
+    ticks++;
+    co_yield();
+  }
+  ssize_t n = write(pair[1], "x", 1);
+  assert(n == 1);
+}
+
+static void sleeper(void *arg) {
+  usleep(50000);
+}
+
+static void poller(void *arg) {
+  struct pollfd p = {.fd = pair[0], .events = POLLIN};
+  int timeout = (int) (long) arg;
+  double start = now_ms();
+  int n = poll(&p, 1, timeout);
+  if (timeout < 1000) {
+    assert(n == 0 && now_ms() - start >= timeout);
+  } else {
+    assert(n == 1 && p.revents & POLLIN && now_ms() - start < 500);
+    char c;
+    ssize_t m = read(pair[0], &c, 1);
+    assert(m == 1);
+  }
+}
+
+static void shared_poller(void *arg) {
+  struct pollfd p = {.fd = pair[0], .events = POLLIN};
+  double start = now_ms();
+  int n = poll(&p, 1, 5000);
+  assert(n == 1 && p.revents & POLLIN && now_ms() - start < 500);
+  ++*(int *) arg;
+}
+
+static void late_writer(void *arg) {
+  struct timespec ts = {0, 10000000};
+  int rc = nanosleep(&ts, NULL);
+  assert(rc == 0);
+  ssize_t n = write(pair[1], "y", 1);
+  assert(n == 1);
+}
+
+static struct sockaddr_in server_addr;
+
+static void server(void *arg) {
+  int listener = *(int *) arg;
+  int fd = accept(listener, NULL, NULL);
+  int flags = fcntl(fd, F_GETFD);
+  assert(fd >= 0 && !(flags & FD_CLOEXEC));
+  char buf[16];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    ssize_t sent = send(fd, buf, n, 0);
+    assert(sent == n);
+  }
+  close(fd);
+}
+
+static void client(void *arg) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int rc = connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+  assert(rc == 0);
+  for (int i = 0; i < 100; i++) {
+    ssize_t sent = send(fd, &i, sizeof(i), 0);
+    assert(sent == sizeof(i));
+    int j;
+    ssize_t n = recv(fd, &j, sizeof(j), 0);
+    assert(n == sizeof(j) && j == i);
+  }
+  close(fd);
+}
+
+static void nonblocking_reader(void *arg) {
+  char c;
+  ssize_t n = read(*(int *) arg, &c, 1);
+  assert(n == -1 && errno == EAGAIN);
+}
+
+static void *late_thread_writer(void *arg) {
+  usleep(10000);
+  ssize_t n = write(pair[1], "z", 1);
+  assert(n == 1);
+  return NULL;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  assert(rc == 0);
+
+  printf("Test #1. Expect: the ticker runs while read blocks\n");
+  int seen = -1;
+  coroutine_t *reader = co_start("reader", blocking_reader, &seen);
+  coroutine_t *tick = co_start("ticker", ticker, NULL);
+  co_wait(reader);
+  co_wait(tick);
+  co_free(reader);
+  co_free(tick);
+  printf("%d ticks\n", seen);
+  assert(seen == 3);
+
+  printf("Test #2. Expect: 4 usleep(50ms) overlap\n");
+  coroutine_t *cos[4];
+  double start = now_ms();
+  for (int i = 0; i < 4; i++) {
+    cos[i] = co_start("sleeper", sleeper, NULL);
+  }
+  for (int i = 0; i < 4; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  double elapsed = now_ms() - start;
+  printf("%s\n", elapsed >= 50 && elapsed < 150 ? "overlapped" : "serialized");
+  assert(elapsed >= 50 && elapsed < 150);
+
+  printf("Test #3. Expect: poll times out, then wakes up on a write\n");
+  cos[0] = co_start("poller", poller, (void *) 20L);
+  co_wait(cos[0]);
+  co_free(cos[0]);
+  cos[0] = co_start("poller", poller, (void *) 5000L);
+  cos[1] = co_start("writer", late_writer, NULL);
+  co_wait(cos[0]);
+  co_wait(cos[1]);
+  co_free(cos[0]);
+  co_free(cos[1]);
+  printf("ok\n");
+
+  printf("Test #4. Expect: accept, connect, send and recv on loopback\n");
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  rc = bind(listener, (struct sockaddr *) &server_addr, sizeof(server_addr));
+  assert(rc == 0);
+  socklen_t len = sizeof(server_addr);
+  rc = getsockname(listener, (struct sockaddr *) &server_addr, &len);
+  assert(rc == 0);
+  rc = listen(listener, 1);
+  assert(rc == 0);
+  cos[0] = co_start("server", server, &listener);
+  cos[1] = co_start("client", client, NULL);
+  co_wait(cos[0]);
+  co_wait(cos[1]);
+  co_free(cos[0]);
+  co_free(cos[1]);
+  close(listener);
+  printf("ok\n");
+
+  // the socket pair is nonblocking since Test #1, the main flow still blocks on it
+  printf("Test #5. Expect: calls outside coroutines and on nonblocking sockets pass through\n");
+  pthread_t thread;
+  pthread_create(&thread, NULL, late_thread_writer, NULL);
+  char c;
+  ssize_t n = read(pair[0], &c, 1);
+  assert(n == 1 && c == 'z');
+  pthread_join(thread, NULL);
+  int nonblocking[2];
+  rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, nonblocking);
+  assert(rc == 0);
+  cos[0] = co_start("reader", nonblocking_reader, &nonblocking[0]);
+  co_wait(cos[0]);
+  co_free(cos[0]);
+  assert(co_self() == NULL);
+  close(nonblocking[0]);
+  close(nonblocking[1]);
+  close(pair[0]);
+  close(pair[1]);
+  printf("ok\n");
+
+  // runtime coroutines poll between yields
+  printf("Test #6. Expect: poll wakes up on a write in runtime coroutines\n");
+  rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  assert(rc == 0);
+  co_runtime_start(2);
+  cos[0] = co_start("poller", poller, (void *) 5000L);
+  cos[1] = co_start("writer", late_writer, NULL);
+  co_wait(cos[0]);
+  co_wait(cos[1]);
+  co_free(cos[0]);
+  co_free(cos[1]);
+  co_runtime_stop();
+  close(pair[0]);
+  close(pair[1]);
+  printf("ok\n");
+
+  printf("Test #7. Expect: two coroutines poll the same socket, and both wake up on a write\n");
+  rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  assert(rc == 0);
+  int polled = 0;
+  cos[0] = co_start("poller", shared_poller, &polled);
+  cos[1] = co_start("poller", shared_poller, &polled);
+  cos[2] = co_start("writer", late_writer, NULL);
+  for (int i = 0; i < 3; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  n = read(pair[0], &c, 1);
+  printf("%d polled\n", polled);
+  assert(polled == 2 && n == 1 && c == 'y');
+  close(pair[0]);
+  close(pair[1]);
+  return 0;
+}
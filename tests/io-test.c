@@ -0,0 +1,289 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+enum { PINGS = 1000, CLIENTS = 4, PAYLOAD = 1 << 20, FILE_SIZE = 4 << 20, COPIERS = 4, CHUNK = 64 * 1024 };
+
+static void ping(void *arg) {
+  int fd = *(int *) arg;
+  for (int i = 0; i < PINGS; i++) {
+    ssize_t n = co_write(fd, &i, sizeof(i));
+    assert(n == sizeof(i));
+    int j;
+    n = co_read(fd, &j, sizeof(j));
+    assert(n == sizeof(j) && j == i + 1);
+  }
+}
+
+static void pong(void *arg) {
+  int fd = *(int *) arg;
+  int i;
+  while (co_read(fd, &i, sizeof(i)) == sizeof(i)) {
+    i++;
+    ssize_t n = co_write(fd, &i, sizeof(i));
+    assert(n == sizeof(i));
+  }
+}
+
+static void echo(void *arg) {
+  int fd = (int) (long) arg;
+  char buf[4096];
+  ssize_t n;
+  while ((n = co_recv(fd, buf, sizeof(buf), 0)) > 0) {
+    for (ssize_t off = 0; off < n;) {
+      ssize_t m = co_send(fd, buf + off, n - off, 0);
+      assert(m > 0);
+      off += m;
+    }
+  }
+  co_close(fd);
+}
+
+static void server(void *arg) {
+  int listener = *(int *) arg;
+  coroutine_t *cos[CLIENTS];
+  for (int i = 0; i < CLIENTS; i++) {
+    int fd = co_accept(listener, NULL, NULL);
+    assert(fd >= 0);
+    cos[i] = co_start("echo", echo, (void *) (long) fd);
+  }
+  for (int i = 0; i < CLIENTS; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+}
+
+// Sends PAYLOAD bytes while the client reads the echo back, so that both directions of fd park at the same time.
+static void sender(void *arg) {
+  int fd = *(int *) arg;
+  static char buf[PAYLOAD];
+  memset(buf, 'x', sizeof(buf));
+  for (size_t off = 0; off < sizeof(buf);) {
+    ssize_t n = co_write(fd, buf + off, sizeof(buf) - off);
+    assert(n > 0);
+    off += n;
+  }
+  shutdown(fd, SHUT_WR);
+}
+
+static struct sockaddr_in server_addr;
+static long echoed;
+
+static void client(void *arg) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int rc = co_connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+  assert(rc == 0);
+  coroutine_t *co = co_start("sender", sender, &fd);
+  char buf[4096];
+  ssize_t n;
+  while ((n = co_read(fd, buf, sizeof(buf))) > 0) {
+    echoed += n;
+  }
+  co_wait(co);
+  co_free(co);
+  co_close(fd);
+}
+
+static void *late_writer(void *arg) {
+  usleep(50 * 1000);
+  write(*(int *) arg, "late", 4);
+  return NULL;
+}
+
+static long cpu_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char late_buf[8];
+
+static void late_reader(void *arg) {
+  ssize_t n = co_read(*(int *) arg, late_buf, sizeof(late_buf));
+  assert(n == 4);
+}
+
+static int flag;
+
+static void set_flag(void *arg) {
+  flag = 1;
+}
+
+static int src_fd, dst_fd;
+
+// Copies its quarter of src_fd to dst_fd at the same offsets.
+static void copier(void *arg) {
+  off_t begin = (long) arg * (FILE_SIZE / COPIERS);
+  char *buf = malloc(CHUNK);
+  for (off_t off = begin; off < begin + FILE_SIZE / COPIERS;) {
+    ssize_t n = co_pread(src_fd, buf, CHUNK, off);
+    assert(n > 0);
+    for (ssize_t done = 0; done < n;) {
+      ssize_t m = co_pwrite(dst_fd, buf + done, n - done, off + done);
+      assert(m > 0);
+      done += m;
+    }
+    off += n;
+  }
+  free(buf);
+}
+
+static int temp_file() {
+  char path[] = "/tmp/io-test-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  unlink(path);
+  return fd;
+}
+
+// Copies a file concurrently with co_pread/co_pwrite, then back sequentially with co_read/co_write, and checks both.
+static int copy_files() {
+  static char data[FILE_SIZE], check[FILE_SIZE];
+  for (int i = 0; i < FILE_SIZE; i++) {
+    data[i] = (char) (i * 7 + i / 4096);
+  }
+  src_fd = temp_file();
+  dst_fd = temp_file();
+  ssize_t n = write(src_fd, data, FILE_SIZE);
+  assert(n == FILE_SIZE);
+  coroutine_t *cos[COPIERS];
+  for (long i = 0; i < COPIERS; i++) {
+    cos[i] = co_start("copier", copier, (void *) i);
+  }
+  for (int i = 0; i < COPIERS; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  n = pread(dst_fd, check, FILE_SIZE, 0);
+  assert(n == FILE_SIZE && memcmp(data, check, FILE_SIZE) == 0);
+  // the file positions are used and moved as by read and write
+  off_t dst_pos = lseek(dst_fd, 0, SEEK_SET);
+  off_t src_pos = lseek(src_fd, 0, SEEK_SET);
+  assert(dst_pos == 0 && src_pos == 0);
+  int copied = 0;
+  while ((n = co_read(dst_fd, check, CHUNK)) > 0) {
+    ssize_t m = co_write(src_fd, check, n);
+    assert(m == n);
+    copied += n;
+  }
+  src_pos = lseek(src_fd, 0, SEEK_CUR);
+  assert(n == 0 && src_pos == FILE_SIZE);
+  n = pread(src_fd, check, FILE_SIZE, 0);
+  assert(n == FILE_SIZE && memcmp(data, check, FILE_SIZE) == 0);
+  n = co_read(-1, check, 1);
+  assert(n == -1 && errno == EBADF);
+  co_close(src_fd);
+  co_close(dst_fd);
+  return copied;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: %d\n", PINGS);
+  int fds[2];
+  int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rc == 0);
+  coroutine_t *co1 = co_start("ping", ping, &fds[0]);
+  coroutine_t *co2 = co_start("pong", pong, &fds[1]);
+  co_wait(co1);
+  co_close(fds[0]);
+  co_wait(co2);
+  co_close(fds[1]);
+  co_free(co1);
+  co_free(co2);
+  printf("%d\n", PINGS);
+
+  printf("Test #2. Expect: %d\n", CLIENTS * PAYLOAD);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_addr.sin_port = 0;
+  rc = bind(listener, (struct sockaddr *) &server_addr, sizeof(server_addr));
+  assert(rc == 0);
+  rc = listen(listener, CLIENTS);
+  assert(rc == 0);
+  socklen_t len = sizeof(server_addr);
+  getsockname(listener, (struct sockaddr *) &server_addr, &len);
+  coroutine_t *srv = co_start("server", server, &listener);
+  coroutine_t *clients[CLIENTS];
+  for (int i = 0; i < CLIENTS; i++) {
+    clients[i] = co_start("client", client, NULL);
+  }
+  for (int i = 0; i < CLIENTS; i++) {
+    co_wait(clients[i]);
+    co_free(clients[i]);
+  }
+  co_wait(srv);
+  co_free(srv);
+  co_close(listener);
+  assert(echoed == (long) CLIENTS * PAYLOAD);
+  printf("%ld\n", echoed);
+
+  printf("Test #3. Expect: late\n");
+  rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rc == 0);
+  pthread_t thread;
+  pthread_create(&thread, NULL, late_writer, &fds[1]);
+  char buf[8] = {0};
+  ssize_t n = co_read(fds[0], buf, sizeof(buf)); // nothing else to run, the scheduler waits in epoll_wait
+  assert(n == 4);
+  pthread_join(thread, NULL);
+  co_close(fds[0]);
+  close(fds[1]);
+  printf("%s\n", buf);
+
+  printf("Test #4. Expect: %d copied through io_uring if available\n", FILE_SIZE);
+  if (co_io_uring(1) == 0) {
+    // the reader parks until the completion is reaped, so the other coroutine runs meanwhile
+    int fd = temp_file();
+    coroutine_t *co = co_start("flag", set_flag, NULL);
+    n = co_pread(fd, buf, sizeof(buf), 0);
+    assert(n == 0 && flag);
+    co_wait(co);
+    co_free(co);
+    co_close(fd);
+  }
+  printf("%d copied through io_uring if available\n", copy_files());
+
+  printf("Test #5. Expect: %d copied with blocking syscalls\n", FILE_SIZE);
+  co_io_uring(0);
+  printf("%d copied with blocking syscalls\n", copy_files());
+
+  printf("Test #6. Expect: %d late, runtime coroutines wait for descriptors while their workers idle\n", PINGS);
+  co_runtime_start(2);
+  rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rc == 0);
+  co1 = co_start("ping", ping, &fds[0]);
+  co2 = co_start("pong", pong, &fds[1]);
+  co_wait(co1);
+  close(fds[0]);
+  co_wait(co2);
+  close(fds[1]);
+  co_free(co1);
+  co_free(co2);
+  rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(rc == 0);
+  long cpu = cpu_ms();
+  co1 = co_start("late_reader", late_reader, &fds[0]);
+  pthread_create(&thread, NULL, late_writer, &fds[1]);
+  co_wait(co1);
+  cpu = cpu_ms() - cpu;
+  pthread_join(thread, NULL);
+  co_free(co1);
+  co_runtime_stop();
+  close(fds[0]);
+  close(fds[1]);
+  printf("%d %s, %ldms of CPU\n", PINGS, late_buf, cpu);
+  assert(cpu < 20);
+  return 0;
+}
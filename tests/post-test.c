@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+enum { POSTS = 1000 };
+
+static co_scheduler_t *sched;
+static coroutine_t *waiter;
+static int posted_runs;
+
+static void posted(void *arg) {
+  if (++posted_runs == POSTS) {
+    co_unpark(waiter);
+  }
+}
+
+static void park_until_all(void *arg) {
+  while (posted_runs < POSTS) {
+    co_park();
+  }
+}
+
+static void *poster(void *arg) {
+  for (int i = 0; i < POSTS; i++) {
+    int rc = co_post(sched, "posted", posted, NULL);
+    assert(rc == 0);
+  }
+  return NULL;
+}
+
+static int woken;
+
+static void parker(void *arg) {
+  co_park();
+  woken = 1;
+}
+
+static void *late_unparker(void *arg) {
+  usleep(20000);
+  co_unpark(waiter);
+  return NULL;
+}
+
+static uint64_t cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *unparker(void *arg) {
+  co_unpark(arg);
+  return NULL;
+}
+
+static void finisher(void *arg) {
+}
+
+static void unpark_self_then_park(void *arg) {
+  co_unpark(co_self());
+  co_park(); // takes the permit
+  *(int *) arg = 1;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  sched = co_scheduler_self();
+
+  printf("Test #1. Expect: a thread posts %d coroutines, which run on this scheduler\n", POSTS);
+  waiter = co_start("waiter", park_until_all, NULL);
+  pthread_t thread;
+  pthread_create(&thread, NULL, poster, NULL);
+  co_wait(waiter);
+  co_free(waiter);
+  pthread_join(thread, NULL);
+  printf("%d runs\n", posted_runs);
+  assert(posted_runs == POSTS);
+
+  printf("Test #2. Expect: a thread unparks a coroutine while the scheduler sleeps\n");
+  waiter = co_start("parker", parker, NULL);
+  pthread_create(&thread, NULL, late_unparker, NULL);
+  co_wait(waiter);
+  co_free(waiter);
+  pthread_join(thread, NULL);
+  printf("woken %d\n", woken);
+  assert(woken);
+
+  printf("Test #3. Expect: co_unpark before co_park leaves a permit\n");
+  int done = 0;
+  coroutine_t *co = co_start("permit", unpark_self_then_park, &done);
+  co_wait(co);
+  co_free(co);
+  printf("done %d\n", done);
+  assert(done);
+
+  printf("Test #4. Expect: runtime coroutines park and get unparked\n");
+  co_runtime_start(2);
+  woken = 0;
+  waiter = co_start("parker", parker, NULL);
+  pthread_create(&thread, NULL, late_unparker, NULL);
+  co_wait(waiter);
+  pthread_join(thread, NULL);
+  co_free(waiter);
+  co_runtime_stop();
+  printf("woken %d\n", woken);
+  assert(woken);
+
+  printf("Test #5. Expect: a coroutine unparked by a thread as it finishes is freed, and its wake-up is dropped\n");
+  co = co_start("finisher", finisher, NULL);
+  co_wait(co);
+  pthread_create(&thread, NULL, unparker, co); // the wake-up is still in the inbox once co_free returns
+  pthread_join(thread, NULL);
+  co_free(co);
+  woken = 0;
+  waiter = co_start("parker", parker, NULL);
+  for (int i = 0; i < 10; i++) {
+    co_yield();
+  }
+  printf("woken %d\n", woken);
+  assert(!woken);
+  co_unpark(waiter);
+  co_wait(waiter);
+  co_free(waiter);
+  assert(woken);
+
+  printf("Test #6. Expect: a parked runtime coroutine leaves its worker idle\n");
+  co_runtime_start(1);
+  woken = 0;
+  waiter = co_start("parker", parker, NULL);
+  usleep(10000); // parked by now
+  uint64_t cpu = cpu_ns();
+  usleep(100000);
+  cpu = cpu_ns() - cpu;
+  co_unpark(waiter);
+  co_wait(waiter);
+  co_free(waiter);
+  co_runtime_stop();
+  printf("%llu us of CPU\n", (unsigned long long) cpu / 1000);
+  assert(woken && cpu < 20000000);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include "coroutine.h"
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int stop;
+static int ticks;
+static double max_gap;
+
+static void ticker(void *arg) {
+  double last = now_ms();
+  while (!stop) {
+    ticks++;
+    co_yield();
+    double now = now_ms();
+    max_gap = now - last > max_gap ? now - last : max_gap;
+    last = now;
+  }
+}
+
+// Like work_loop of naive.c, without the co_yield.
+static void spinner(void *arg) {
+  int *preempted = arg;
+  double end = now_ms() + 200;
+  while (now_ms() < end) {
+    *preempted += co_preempt_point();
+  }
+  stop = 1;
+}
+
+// Without a safe point, nothing switches it out.
+static void bare_spinner(void *arg) {
+  double end = now_ms() + 100;
+  while (now_ms() < end) {
+  }
+  stop = 1;
+}
+
+static void chan_spinner(void *arg) {
+  co_chan_t *chan = co_chan_new(sizeof(int), 1);
+  double end = now_ms() + 200;
+  for (int i = 0; now_ms() < end; i++) {
+    int j;
+    int sent = co_chan_send(chan, &i);
+    int received = co_chan_recv(chan, &j);
+    assert(sent == 0 && received == 0 && j == i);
+  }
+  co_chan_free(chan);
+  stop = 1;
+}
+
+static volatile sig_atomic_t urgent;
+
+static void on_urgent(int sig) {
+  urgent++;
+}
+
+static void run(void (*func)(void *), void *arg) {
+  stop = 0;
+  ticks = 0;
+  max_gap = 0;
+  coroutine_t *tick = co_start("ticker", ticker, NULL);
+  coroutine_t *spin = co_start("spinner", func, arg);
+  co_wait(spin);
+  co_wait(tick);
+  co_free(spin);
+  co_free(tick);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  signal(SIGURG, on_urgent);
+
+  // the kernel rounds the slice up to its tick, up to 10ms
+  printf("Test #1. Expect: a spinning coroutine with a safe point in its loop is preempted every 20ms or so\n");
+  int rc = co_preempt_start(20000000);
+  assert(rc == 0);
+  int preempted = 0;
+  run(spinner, &preempted);
+  printf("%s\n", preempted >= 4 && ticks >= 4 && max_gap < 50 ? "preempted" : "starved");
+  assert(preempted >= 4 && ticks >= 4 && max_gap < 50);
+
+  printf("Test #2. Expect: channel operations that never block are safe points\n");
+  run(chan_spinner, NULL);
+  printf("%s\n", ticks >= 4 && max_gap < 50 ? "preempted" : "starved");
+  assert(ticks >= 4 && max_gap < 50);
+
+  printf("Test #3. Expect: no preemption once stopped\n");
+  co_preempt_stop();
+  preempted = 0;
+  run(spinner, &preempted);
+  printf("%d preemptions, %d ticks\n", preempted, ticks);
+  assert(preempted == 0 && ticks == 1);
+  rc = co_preempt_start(0);
+  assert(rc == -1);
+
+  printf("Test #4. Expect: a SIGURG that is not a tick reaches the handler installed before\n");
+  rc = co_preempt_start(20000000);
+  assert(rc == 0);
+  raise(SIGURG);
+  co_preempt_stop();
+  raise(SIGURG);
+  printf("%d urgent\n", urgent);
+  assert(urgent == 2);
+
+  printf("Test #5. Expect: a loop without a safe point is not preempted\n");
+  rc = co_preempt_start(20000000);
+  assert(rc == 0);
+  run(bare_spinner, NULL);
+  co_preempt_stop();
+  printf("%d ticks\n", ticks);
+  assert(ticks == 1);
+  return 0;
+}
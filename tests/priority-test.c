@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "coroutine.h"
+
+static char order[256];
+static int order_len;
+
+static void record(void *arg) {
+  order[order_len++] = *(const char *) arg;
+}
+
+static void record_yield(void *arg) {
+  for (int i = 0; i < 3; i++) {
+    record(arg);
+    co_yield();
+  }
+}
+
+static int high_runs;
+static int high_runs_seen;
+
+static void high_spinner(void *arg) {
+  for (int i = 0; i < 1000; i++) {
+    high_runs++;
+    co_yield();
+  }
+}
+
+static int normal_runs;
+
+static void normal_spinner(void *arg) {
+  for (int i = 0; i < 1000; i++) {
+    normal_runs++;
+    co_yield();
+  }
+}
+
+static void low_once(void *arg) {
+  high_runs_seen = high_runs + normal_runs;
+}
+
+static coroutine_t *start(const char *name, void (*func)(void *), void *arg, enum co_priority priority) {
+  co_attr_t attr = {.priority = priority};
+  return co_start_ex(name, func, arg, &attr);
+}
+
+static void run(coroutine_t **cos, int n) {
+  for (int i = 0; i < n; i++) {
+    co_wait(cos[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    co_free(cos[i]);
+  }
+  order[order_len] = '\0';
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: HAB\n");
+  coroutine_t *cos[3];
+  order_len = 0;
+  cos[0] = start("a", record, "A", CO_PRIORITY_NORMAL);
+  cos[1] = start("b", record, "B", CO_PRIORITY_NORMAL);
+  cos[2] = start("h", record, "H", CO_PRIORITY_HIGH);
+  run(cos, 3);
+  printf("%s\n", order);
+  assert(strcmp(order, "HAB") == 0);
+
+  printf("Test #2. Expect: NNNLLL\n");
+  order_len = 0;
+  cos[0] = start("l", record_yield, "L", CO_PRIORITY_LOW);
+  cos[1] = start("n", record_yield, "N", CO_PRIORITY_NORMAL);
+  run(cos, 2);
+  printf("%s\n", order);
+  assert(strcmp(order, "NNNLLL") == 0);
+
+  printf("Test #3. Expect: BA\n");
+  order_len = 0;
+  cos[0] = co_start("a", record, "A");
+  cos[1] = co_start("b", record, "B");
+  co_set_priority(cos[1], CO_PRIORITY_HIGH);
+  run(cos, 2);
+  printf("%s\n", order);
+  assert(strcmp(order, "BA") == 0);
+
+  // the starvation guard gives a pick to the low level every so many picks of the high one
+  printf("Test #4. Expect: the low coroutine runs before the high one is done\n");
+  high_runs = 0;
+  cos[0] = start("high", high_spinner, NULL, CO_PRIORITY_HIGH);
+  cos[1] = start("low", low_once, NULL, CO_PRIORITY_LOW);
+  run(cos, 2);
+  printf("%s\n", high_runs_seen > 0 && high_runs_seen < 100 ? "ok" : "starved");
+  assert(high_runs_seen > 0 && high_runs_seen < 100);
+
+  // every pick of the high and normal levels counts against the low one
+  printf("Test #5. Expect: the low coroutine runs while the high and normal ones are busy\n");
+  high_runs = 0;
+  normal_runs = 0;
+  high_runs_seen = -1;
+  cos[0] = start("high", high_spinner, NULL, CO_PRIORITY_HIGH);
+  cos[1] = start("normal", normal_spinner, NULL, CO_PRIORITY_NORMAL);
+  cos[2] = start("low", low_once, NULL, CO_PRIORITY_LOW);
+  run(cos, 3);
+  printf("%s\n", high_runs_seen > 0 && high_runs_seen < 100 ? "ok" : "starved");
+  assert(high_runs_seen > 0 && high_runs_seen < 100);
+  return 0;
+}
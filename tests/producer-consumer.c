@@ -6,10 +6,7 @@
 
 int g_count = 200;
 
-static int g_running = 1;
-
-static void do_produce(Queue *queue) {
-  assert(!q_is_full(queue));
+static void do_produce(co_chan_t *chan) {
   Item *item = (Item *) malloc(sizeof(Item));
   if (!item) {
     fprintf(stderr, "New item failure\n");
@@ -23,62 +20,49 @@ static void do_produce(Queue *queue) {
   }
   memset(item->data, 0, 10);
   sprintf(item->data, "libco-%d", g_count++);
-  q_push(queue, item);
+  int rc = co_chan_send(chan, &item);
+  assert(rc == 0);
 }
 
 static void producer(void *arg) {
-  Queue *queue = (Queue *) arg;
-  for (int i = 0; i < 100;) {
-    if (!q_is_full(queue)) {
-      do_produce(queue);
-      i += 1;
-    }
-    co_yield();
+  co_chan_t *chan = (co_chan_t *) arg;
+  for (int i = 0; i < 100; i++) {
+    do_produce(chan);
   }
 }
 
-static void do_consume(Queue *queue) {
-  assert(!q_is_empty(queue));
-  Item *item = q_pop(queue);
-  if (item) {
-    printf("%s  ", (char *) item->data);
-    free(item->data);
-    free(item);
-  }
+static void do_consume(Item *item) {
+  printf("%s  ", (char *) item->data);
+  free(item->data);
+  free(item);
 }
 
 static void consumer(void *arg) {
-  Queue *queue = (Queue *) arg;
-  while (g_running) {
-    if (!q_is_empty(queue)) {
-      do_consume(queue);
-    }
-    co_yield();
+  co_chan_t *chan = (co_chan_t *) arg;
+  Item *item;
+  while (co_chan_recv(chan, &item) == 0) {
+    do_consume(item);
   }
 }
 
 static void test_2() {
 
-  Queue *queue = q_new();
+  co_chan_t *chan = co_chan_new(sizeof(Item *), 100);
 
-  coroutine_t *thd1 = co_start("producer-1", producer, queue);
-  coroutine_t *thd2 = co_start("producer-2", producer, queue);
-  coroutine_t *thd3 = co_start("consumer-1", consumer, queue);
-  coroutine_t *thd4 = co_start("consumer-2", consumer, queue);
+  coroutine_t *thd1 = co_start("producer-1", producer, chan);
+  coroutine_t *thd2 = co_start("producer-2", producer, chan);
+  coroutine_t *thd3 = co_start("consumer-1", consumer, chan);
+  coroutine_t *thd4 = co_start("consumer-2", consumer, chan);
 
   co_wait(thd1);
   co_wait(thd2);
 
-  g_running = 0;
+  co_chan_close(chan); // the consumers drain the channel, then see it closed
 
   co_wait(thd3);
   co_wait(thd4);
 
-  while (!q_is_empty(queue)) {
-    do_consume(queue);
-  }
-
-  q_free(queue);
+  co_chan_free(chan);
 
   co_free(thd1);
   co_free(thd2);
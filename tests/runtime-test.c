@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+enum { WORKERS = 4, COROUTINES = 64, ROUNDS = 1000 };
+
+static int count;
+static int migrations;
+
+static void work(void *arg) {
+  co_scheduler_t *sched = co_scheduler_self();
+  for (int i = 0; i < ROUNDS; i++) {
+    __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    co_yield();
+    if (co_scheduler_self() != sched) {
+      sched = co_scheduler_self();
+      __atomic_add_fetch(&migrations, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+struct fib {
+  int n;
+  long result;
+};
+
+// Every call waits for two coroutines that any worker may run.
+static void fib(void *arg) {
+  struct fib *f = arg;
+  if (f->n < 2) {
+    f->result = f->n;
+    return;
+  }
+  struct fib a = {f->n - 1, 0};
+  struct fib b = {f->n - 2, 0};
+  coroutine_t *ca = co_start("fib", fib, &a);
+  coroutine_t *cb = co_start("fib", fib, &b);
+  co_wait(ca);
+  co_wait(cb);
+  co_free(ca);
+  co_free(cb);
+  f->result = a.result + b.result;
+}
+
+static void local(void *arg) {
+  ++*(int *) arg;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  co_runtime_start(WORKERS);
+
+  printf("Test #1. Expect: %d\n", COROUTINES * ROUNDS);
+  coroutine_t *cos[COROUTINES];
+  for (int i = 0; i < COROUTINES; i++) {
+    cos[i] = co_start("work", work, NULL);
+  }
+  for (int i = 0; i < COROUTINES; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  assert(count == COROUTINES * ROUNDS);
+  printf("%d (%d migrations)\n", count, migrations);
+
+  printf("Test #2. Expect: 610\n");
+  struct fib f = {15, 0};
+  coroutine_t *root = co_start("fib", fib, &f);
+  co_wait(root);
+  co_free(root);
+  assert(f.result == 610);
+  printf("%ld\n", f.result);
+
+  co_runtime_stop();
+
+  printf("Test #3. Expect: 1\n");
+  int done = 0;
+  coroutine_t *co = co_start("local", local, &done);
+  co_wait(co);
+  co_free(co);
+  assert(done == 1);
+  printf("%d\n", done);
+  return 0;
+}
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+enum { MS = 1000000 };
+
+struct pair {
+  co_chan_t *a;
+  co_chan_t *b;
+  int fd;
+};
+
+static void late_send(void *arg) {
+  co_chan_t *chan = arg;
+  co_sleep_ns(10 * MS);
+  int v = 7;
+  co_chan_send(chan, &v);
+}
+
+static void late_write(void *arg) {
+  co_sleep_ns(10 * MS);
+  write(*(int *) arg, "x", 1);
+}
+
+static void late_recv(void *arg) {
+  co_chan_t *chan = arg;
+  co_sleep_ns(10 * MS);
+  int v;
+  co_chan_recv(chan, &v);
+  assert(v == 4 || v == 5);
+}
+
+static int selected;
+
+// Waits on a channel, a descriptor and a timeout from a shared stack.
+static void selector(void *arg) {
+  struct pair *p = arg;
+  int v = 0;
+  co_select_case_t cases[] = {
+      {.op = CO_SELECT_RECV, .chan = p->a, .elem = &v},
+      {.op = CO_SELECT_READ, .fd = p->fd},
+  };
+  selected = co_select(cases, 2, 1000 * MS) * 10 + v;
+}
+
+static long cpu_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *late_write_thread(void *arg) {
+  usleep(50 * 1000);
+  write(*(int *) arg, "x", 1);
+  return NULL;
+}
+
+static int fd_selected[2];
+
+// Waits on two descriptors from a runtime coroutine, first until a timeout.
+static void fd_selector(void *arg) {
+  int *fds = arg;
+  co_select_case_t cases[] = {
+      {.op = CO_SELECT_READ, .fd = fds[0]},
+      {.op = CO_SELECT_READ, .fd = fds[1]},
+  };
+  fd_selected[0] = co_select(cases, 2, 20 * MS);
+  fd_selected[1] = co_select(cases, 2, -1);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: 1 7 0\n");
+  co_chan_t *a = co_chan_new(sizeof(int), 0);
+  co_chan_t *b = co_chan_new(sizeof(int), 0);
+  int v = 0;
+  co_select_case_t cases[3] = {
+      {.op = CO_SELECT_RECV, .chan = a, .elem = &v},
+      {.op = CO_SELECT_RECV, .chan = b, .elem = &v},
+  };
+  coroutine_t *co = co_start("late_send", late_send, b);
+  coroutine_t *co2;
+  int r = co_select(cases, 2, -1);
+  printf("%d %d %d\n", r, v, cases[r].ok);
+  assert(r == 1 && v == 7 && cases[1].ok == 0);
+  co_wait(co);
+  co_free(co);
+
+  printf("Test #2. Expect: -1\n");
+  // a is no longer waited on by the select above, so nobody receives from it
+  co_select_case_t send = {.op = CO_SELECT_SEND, .chan = a, .elem = &v};
+  r = co_select(&send, 1, 0);
+  assert(r == -1);
+  r = co_select(cases, 2, 20 * MS);
+  printf("%d\n", r);
+  assert(r == -1);
+
+  printf("Test #3. Expect: 2\n");
+  int fds[2];
+  r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(r == 0);
+  cases[2] = (co_select_case_t) {.op = CO_SELECT_READ, .fd = fds[0]};
+  co = co_start("late_write", late_write, &fds[1]);
+  r = co_select(cases, 3, -1);
+  printf("%d\n", r);
+  assert(r == 2);
+  co_wait(co);
+  co_free(co);
+  char c;
+  ssize_t n = co_read(fds[0], &c, 1);
+  assert(n == 1);
+
+  printf("Test #4. Expect: 0 0\n");
+  co_chan_t *full = co_chan_new(sizeof(int), 1);
+  v = 4;
+  co_chan_send(full, &v);
+  v = 5;
+  send = (co_select_case_t) {.op = CO_SELECT_SEND, .chan = full, .elem = &v};
+  co = co_start("late_recv", late_recv, full);
+  co2 = co_start("late_recv", late_recv, full);
+  r = co_select(&send, 1, -1); // sent once the first receiver makes room
+  printf("%d %d\n", r, send.ok);
+  assert(r == 0 && send.ok == 0);
+  co_wait(co);
+  co_wait(co2);
+  co_free(co);
+  co_free(co2);
+
+  printf("Test #5. Expect: 0 -1\n");
+  co_chan_close(a);
+  r = co_select(cases, 2, -1);
+  printf("%d %d\n", r, cases[0].ok);
+  assert(r == 0 && cases[0].ok == -1);
+
+  printf("Test #6. Expect: 10 7\n");
+  co_attr_t shared = {.stack_kind = CO_STACK_SHARED};
+  struct pair p = {b, NULL, fds[0]};
+  co = co_start_ex("selector", selector, &p, &shared);
+  co2 = co_start_ex("late_write", late_write, &fds[1], &shared);
+  co_wait(co);
+  co_wait(co2);
+  co_free(co);
+  co_free(co2);
+  printf("%d ", selected);
+  assert(selected == 10);
+  n = co_read(fds[0], &c, 1);
+  assert(n == 1);
+  co = co_start_ex("selector", selector, &p, &shared);
+  co2 = co_start_ex("late_send", late_send, b, &shared);
+  co_wait(co);
+  co_wait(co2);
+  co_free(co);
+  co_free(co2);
+  printf("%d\n", selected);
+  assert(selected == 7);
+
+  printf("Test #7. Expect: 7\n");
+  // a negative descriptor is never ready, as with poll
+  p.fd = -1;
+  co = co_start("selector", selector, &p);
+  co2 = co_start("late_send", late_send, b);
+  co_wait(co);
+  co_wait(co2);
+  co_free(co);
+  co_free(co2);
+  printf("%d\n", selected);
+  assert(selected == 7);
+
+  printf("Test #8. Expect: -1 1, runtime coroutines select while their workers idle\n");
+  int pair[2];
+  int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  assert(rc == 0);
+  int readers[2] = {fds[0], pair[0]};
+  co_runtime_start(2);
+  long cpu = cpu_ms();
+  co = co_start("fd_selector", fd_selector, readers);
+  pthread_t thread;
+  pthread_create(&thread, NULL, late_write_thread, &pair[1]);
+  co_wait(co);
+  cpu = cpu_ms() - cpu;
+  pthread_join(thread, NULL);
+  co_free(co);
+  co_runtime_stop();
+  close(pair[0]);
+  close(pair[1]);
+  printf("%d %d, %ldms of CPU\n", fd_selected[0], fd_selected[1], cpu);
+  assert(fd_selected[0] == -1 && fd_selected[1] == 1 && cpu < 20);
+
+  co_close(fds[0]);
+  close(fds[1]);
+  co_chan_free(a);
+  co_chan_free(b);
+  co_chan_free(full);
+  return 0;
+}
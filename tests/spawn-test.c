@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+static int g_count = 0;
+
+static void work(void *arg) {
+  co_yield();
+  g_count += *(int *) arg;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  enum { N = 1000 };
+  static coroutine_t *cos[N];
+  static int args[N];
+
+  printf("Test #1. Expect: coroutines with short and long names\n");
+  for (int i = 0; i < N; i++) {
+    args[i] = 1;
+    cos[i] = co_start(i % 2 == 0 ? "short" : "a-name-too-long-to-be-stored-inline-in-the-control-block", work,
+                      &args[i]);
+  }
+  for (int i = 0; i < N; i++) {
+    co_wait(cos[i]);
+  }
+  for (int i = 0; i < N; i++) {
+    co_free(cos[i]);
+  }
+  assert(g_count == N);
+  printf("%d\n", g_count);
+
+  printf("Test #2. Expect: dead coroutines released at once by co_arena_release\n");
+  for (int i = 0; i < N; i++) {
+    cos[i] = co_start(i % 2 == 0 ? "short" : "a-name-too-long-to-be-stored-inline-in-the-control-block", work,
+                      &args[i]);
+  }
+  for (int i = 0; i < N; i++) {
+    co_wait(cos[i]);
+  }
+  co_arena_release();
+  assert(g_count == 2 * N);
+  printf("%d\n", g_count);
+
+  printf("Test #3. Expect: a batch started at once, run in order and freed at once\n");
+  static void *batch_args[N];
+  for (int i = 0; i < N; i++) {
+    args[i] = i;
+    batch_args[i] = &args[i];
+  }
+  g_count = 0;
+  co_start_batch(cos, N, "batch", work, batch_args, NULL);
+  for (int i = 0; i < N; i++) {
+    co_wait(cos[i]);
+  }
+  co_free_batch(cos, N);
+  assert(g_count == N * (N - 1) / 2);
+  printf("%d\n", g_count);
+
+  printf("Test #4. Expect: a batch of malloc'ed stacks and a batch of shared stacks\n");
+  g_count = 0;
+  co_attr_t malloc_attr = {.stack_kind = CO_STACK_MALLOC};
+  co_attr_t shared_attr = {.stack_kind = CO_STACK_SHARED};
+  co_start_batch(cos, N / 2, "malloc", work, batch_args, &malloc_attr);
+  co_start_batch(cos + N / 2, N / 2, "shared", work, batch_args, &shared_attr);
+  for (int i = 0; i < N; i++) {
+    co_wait(cos[i]);
+  }
+  co_free_batch(cos, N);
+  assert(g_count == 2 * ((N / 2) * (N / 2 - 1) / 2));
+  printf("%d\n", g_count);
+  return 0;
+}
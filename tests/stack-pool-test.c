@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+static void work(void *arg) {
+  co_yield();
+}
+
+static void spawn_and_free(int n) {
+  coroutine_t *cos[16];
+  assert(n <= 16);
+  for (int i = 0; i < n; i++) {
+    cos[i] = co_start("worker", work, NULL);
+  }
+  for (int i = 0; i < n; i++) {
+    co_wait(cos[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    co_free(cos[i]);
+  }
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  struct co_stack_pool_stats stats;
+
+  printf("Test #1. Expect: stacks of dead coroutines are reused\n");
+  co_stack_pool_config(4, 0);
+  spawn_and_free(4);
+  co_stack_pool_get_stats(&stats);
+  assert(stats.hits == 0 && stats.misses == 4 && stats.size == 4);
+  spawn_and_free(4);
+  co_stack_pool_get_stats(&stats);
+  assert(stats.hits == 4 && stats.misses == 4 && stats.size == 4);
+  printf("hits=%lu misses=%lu size=%zu\n", stats.hits, stats.misses, stats.size);
+
+  printf("Test #2. Expect: the pool never holds more than cap stacks\n");
+  spawn_and_free(8);
+  co_stack_pool_get_stats(&stats);
+  assert(stats.hits == 8 && stats.misses == 8 && stats.size == 4);
+  printf("hits=%lu misses=%lu size=%zu\n", stats.hits, stats.misses, stats.size);
+
+  printf("Test #3. Expect: pre-warming and shrinking at runtime\n");
+  co_stack_pool_config(16, 12);
+  co_stack_pool_get_stats(&stats);
+  assert(stats.size == 12 && stats.cap == 16);
+  co_stack_pool_config(2, 0);
+  co_stack_pool_get_stats(&stats);
+  assert(stats.size == 2 && stats.cap == 2);
+  printf("size=%zu cap=%zu\n", stats.size, stats.cap);
+  return 0;
+}
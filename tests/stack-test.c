@@ -0,0 +1,219 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+static long rss_kb() {
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  long kb = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      kb = strtol(line + 6, NULL, 10);
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  return kb;
+}
+
+static int recurse(int depth) {
+  volatile char frame[1024];
+  frame[0] = (char) depth;
+  if (depth == 0) {
+    return frame[0];
+  }
+  return recurse(depth - 1) + frame[0];
+}
+
+static void deep_work(void *arg) {
+  recurse(*(int *) arg);
+  co_yield();
+}
+
+static void idle_work(void *arg) {
+  co_yield();
+}
+
+static void fan_work(void *arg) {
+  co_yield();
+}
+
+static void zero_work(void *arg) {
+  char *first = arg;
+  volatile char frame[16 * 1024];
+  for (size_t i = 0; i < sizeof(frame); i++) {
+    frame[i] = 0;
+  }
+  co_yield();
+  *first = frame[0];
+}
+
+static void shared_work(void *arg) {
+  int id = *(int *) arg;
+  volatile int frame[256];
+  for (int i = 0; i < 256; i++) {
+    frame[i] = id * 1000 + i;
+  }
+  for (int round = 0; round < 10; round++) {
+    co_yield();
+    for (int i = 0; i < 256; i++) {
+      assert(frame[i] == id * 1000 + i);
+    }
+  }
+  if (id % 2 == 0) {
+    *(int *) arg = recurse(20);
+  }
+}
+
+static void run(const co_attr_t *attr, void (*func)(void *), void *arg) {
+  coroutine_t *co = co_start_ex("worker", func, arg, attr);
+  co_wait(co);
+  co_free(co);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: a 1MB stack holds a deep recursion\n");
+  co_attr_t big = {.stack_size = 1024 * 1024, .stack_kind = CO_STACK_MMAP};
+  int depth = 800;
+  run(&big, deep_work, &depth);
+  printf("ok\n");
+
+  printf("Test #2. Expect: idle 1MB stacks only commit the pages they touch\n");
+  enum { N = 64 };
+  coroutine_t *cos[N];
+  long before = rss_kb();
+  for (int i = 0; i < N; i++) {
+    cos[i] = co_start_ex("idle", idle_work, NULL, &big);
+  }
+  co_yield();
+  long after = rss_kb();
+  for (int i = 0; i < N; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  assert(after - before < N * 1024 / 4);
+  printf("ok\n");
+
+  printf("Test #3. Expect: malloc'ed stacks of a custom size\n");
+  co_attr_t small = {.stack_size = 16 * 1024, .stack_kind = CO_STACK_MALLOC};
+  depth = 4;
+  run(&small, deep_work, &depth);
+  printf("ok\n");
+
+  printf("Test #4. Expect: coroutines on shared stacks keep their frames across switches\n");
+  enum { M = 12 };
+  co_attr_t shared = {.stack_kind = CO_STACK_SHARED};
+  int ids[M];
+  for (int i = 0; i < M; i++) {
+    ids[i] = i;
+    cos[i] = co_start_ex("shared", shared_work, &ids[i], i % 3 == 0 ? NULL : &shared);
+  }
+  for (int i = 0; i < M; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  for (int i = 0; i < M; i += 2) {
+    assert(ids[i] == recurse(20));
+  }
+  printf("ok\n");
+
+  printf("Test #5. Expect: overflowing a stack hits the guard page\n");
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    co_attr_t tiny = {.stack_size = 16 * 1024, .stack_kind = CO_STACK_MMAP};
+    depth = 64;
+    run(&tiny, deep_work, &depth);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  printf("ok\n");
+
+  printf("Test #6. Expect: the high water of painted stacks, parked and dead\n");
+  co_stack_paint(1);
+  depth = 20;
+  coroutine_t *deep = co_start("deep", deep_work, &depth);
+  coroutine_t *idle = co_start("idle", idle_work, NULL);
+  co_yield();
+  size_t high_water = co_stack_high_water(deep);
+  assert(high_water > 20 * 1024 && high_water < 32 * 1024);
+  size_t idle_high_water = co_stack_high_water(idle);
+  assert(idle_high_water > 0 && idle_high_water <= 4096); // a page, if the stack is fresh
+  co_wait(deep);
+  co_wait(idle);
+  assert(co_stack_high_water(deep) == high_water);
+  co_free(deep);
+  co_free(idle);
+  // the stack of deep is reused from the pool, and painted again
+  idle = co_start("idle", idle_work, NULL);
+  co_wait(idle);
+  idle_high_water = co_stack_high_water(idle);
+  assert(idle_high_water > 0 && idle_high_water < 4096);
+  co_free(idle);
+  co_stack_paint(0);
+  printf("ok\n");
+
+  printf("Test #7. Expect: adaptive stacks fit a recursion deeper than the default stack\n");
+  co_stack_adaptive(1);
+  depth = 100;
+  for (int i = 0; i < 3; i++) {
+    deep = co_start("deep", deep_work, &depth); // learns its peak on the first run
+    idle = co_start("idle", idle_work, NULL);
+    co_wait(deep);
+    co_wait(idle);
+    // measured on the probe and on the first learned size, then once in 64 runs
+    high_water = co_stack_high_water(deep);
+    assert(i < 2 ? high_water > 100 * 1024 : high_water == 0);
+    idle_high_water = co_stack_high_water(idle);
+    assert(idle_high_water <= 4096);
+    co_free(deep);
+    co_free(idle);
+  }
+  printf("ok\n");
+
+  printf("Test #8. Expect: a frame of zeros is counted, and adaptive stacks come from the pool\n");
+  char first = 1;
+  coroutine_t *zero = co_start("zero", zero_work, &first);
+  co_wait(zero);
+  assert(first == 0 && co_stack_high_water(zero) > 16 * 1024);
+  co_free(zero);
+  struct co_stack_pool_stats pool_before, pool_after;
+  co_stack_pool_get_stats(&pool_before);
+  for (int i = 0; i < 10; i++) {
+    zero = co_start("zero", zero_work, &first);
+    co_wait(zero);
+    co_free(zero);
+  }
+  co_stack_pool_get_stats(&pool_after);
+  printf("%lu hits\n", pool_after.hits - pool_before.hits);
+  assert(pool_after.hits - pool_before.hits == 9); // the first one maps the stack of the learned size
+  printf("ok\n");
+
+  printf("Test #9. Expect: before any sample, only one coroutine of a fan-out probes\n");
+  coroutine_t *fan[8];
+  for (int i = 0; i < 8; i++) {
+    fan[i] = co_start("fan", fan_work, NULL);
+  }
+  co_yield();
+  for (int i = 0; i < 8; i++) {
+    high_water = co_stack_high_water(fan[i]);
+    assert(i == 0 ? high_water > 0 : high_water == 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    co_wait(fan[i]);
+    co_free(fan[i]);
+  }
+  co_stack_adaptive(0);
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "coroutine.h"
+
+static void yielder(void *arg) {
+  for (int i = 0; i < 10; i++) {
+    co_yield();
+  }
+}
+
+static void deep(void *arg) {
+  volatile char frame[8192];
+  memset((char *) frame, 1, sizeof(frame));
+  co_yield();
+}
+
+static void sleeper(void *arg) {
+  co_sleep_ns(2000000);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  struct co_scheduler_stats sched;
+  if (co_scheduler_stats(&sched) != 0) {
+    printf("Statistics are compiled out\n");
+    return 0;
+  }
+
+  // switched in once to start, then back from each of its yields to the other one
+  printf("Test #1. Expect: 11 switches\n");
+  coroutine_t *co = co_start("yielder", yielder, NULL);
+  coroutine_t *other = co_start("yielder", yielder, NULL);
+  co_wait(co);
+  co_wait(other);
+  struct co_stats stats;
+  int rc = co_stats(co, &stats);
+  assert(rc == 0);
+  printf("%lu switches\n", (unsigned long) stats.switches);
+  assert(stats.switches == 11 && stats.run_cycles > 0);
+  co_free(co);
+  co_free(other);
+
+  printf("Test #2. Expect: 8KB < high water < 32KB\n");
+  co = co_start("deep", deep, NULL);
+  other = co_start("yielder", yielder, NULL);
+  co_wait(co);
+  co_wait(other);
+  co_free(other);
+  co_stats(co, &stats);
+  int deep_enough = stats.stack_high_water > 8192 && stats.stack_high_water < 32768;
+  printf("%s\n", deep_enough ? "8KB < high water < 32KB" : "wrong");
+  assert(deep_enough);
+  co_free(co);
+
+  // a parked coroutine accounts its wait, not a ready one
+  printf("Test #3. Expect: waited\n");
+  co = co_start("sleeper", sleeper, NULL);
+  other = co_start("yielder", yielder, NULL);
+  co_wait(co);
+  co_wait(other);
+  co_free(other);
+  co_stats(co, &stats);
+  printf("%s\n", stats.wait_cycles > stats.ready_cycles ? "waited" : "wrong");
+  assert(stats.wait_cycles > stats.ready_cycles);
+  co_free(co);
+
+  printf("Test #4. Expect: 6 started, 0 live\n");
+  co_scheduler_stats(&sched);
+  printf("%lu started, %lu live\n", sched.started, sched.live);
+  assert(sched.started == 6 && sched.live == 0 && sched.switches > 0 && sched.cycles_per_sec > 0);
+  assert(sched.ready_len == 1 && sched.waiting_len == 0 && sched.ready_len_max >= 1);
+  return 0;
+}
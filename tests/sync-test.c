@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+enum { WORKERS = 4, ROUNDS = 100 };
+
+static co_mutex_t *mutex;
+static co_cond_t *cond;
+static co_sem_t *sem;
+static co_waitgroup_t *wg;
+
+static int trace[16];
+static int traced;
+
+static void locker(void *arg) {
+  co_mutex_lock(mutex);
+  trace[traced++] = (int) (long) arg;
+  co_yield();
+  co_mutex_unlock(mutex);
+}
+
+static long counter;
+
+static void incrementer(void *arg) {
+  (void) arg;
+  for (int i = 0; i < ROUNDS; i++) {
+    co_mutex_lock(mutex);
+    long v = counter;
+    co_yield(); // the others park on the mutex meanwhile
+    counter = v + 1;
+    co_mutex_unlock(mutex);
+  }
+  co_waitgroup_done(wg);
+}
+
+static int items;
+
+static void consumer(void *arg) {
+  co_mutex_lock(mutex);
+  while (items == 0) {
+    co_cond_wait(cond, mutex);
+  }
+  items--;
+  trace[traced++] = (int) (long) arg;
+  co_mutex_unlock(mutex);
+}
+
+static int inside, max_inside;
+
+static void limited(void *arg) {
+  (void) arg;
+  co_sem_wait(sem);
+  inside++;
+  max_inside = inside > max_inside ? inside : max_inside;
+  co_yield();
+  co_yield();
+  inside--;
+  co_sem_post(sem);
+  co_waitgroup_done(wg);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  // the mutex is handed over to its waiters in the order they parked
+  printf("Test #1. Expect: 0 1 2 3\n");
+  mutex = co_mutex_new();
+  coroutine_t *cos[8];
+  for (long i = 0; i < 4; i++) {
+    cos[i] = co_start("locker", locker, (void *) i);
+  }
+  for (int i = 0; i < 4; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  for (int i = 0; i < traced; i++) {
+    printf("%d ", trace[i]);
+  }
+  printf("\n");
+  assert(traced == 4 && trace[0] == 0 && trace[1] == 1 && trace[2] == 2 && trace[3] == 3);
+  int first = co_mutex_trylock(mutex);
+  int second = co_mutex_trylock(mutex);
+  assert(first == 0 && second == -1);
+  co_mutex_unlock(mutex);
+
+  // no increment is lost, and the wait group waits for all the workers
+  printf("Test #2. Expect: %d\n", WORKERS * ROUNDS);
+  wg = co_waitgroup_new();
+  co_waitgroup_add(wg, WORKERS);
+  for (int i = 0; i < WORKERS; i++) {
+    cos[i] = co_start("incrementer", incrementer, NULL);
+  }
+  co_waitgroup_wait(wg);
+  printf("%ld\n", counter);
+  assert(counter == WORKERS * ROUNDS);
+  for (int i = 0; i < WORKERS; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+
+  // signal wakes the waiters one at a time in order, broadcast wakes the rest
+  printf("Test #3. Expect: 0 1 2 3\n");
+  cond = co_cond_new();
+  traced = 0;
+  for (long i = 0; i < 4; i++) {
+    cos[i] = co_start("consumer", consumer, (void *) i);
+  }
+  co_yield(); // all of them wait on the condition
+  co_mutex_lock(mutex);
+  items = 1;
+  co_cond_signal(cond);
+  co_mutex_unlock(mutex);
+  co_wait(cos[0]);
+  co_mutex_lock(mutex);
+  items = 3;
+  co_cond_broadcast(cond);
+  co_mutex_unlock(mutex);
+  for (int i = 0; i < 4; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  for (int i = 0; i < traced; i++) {
+    printf("%d ", trace[i]);
+  }
+  printf("\n");
+  assert(traced == 4 && trace[0] == 0 && trace[1] == 1 && trace[2] == 2 && trace[3] == 3);
+  co_cond_free(cond);
+  co_mutex_free(mutex);
+
+  // the semaphore lets at most 2 of them in at once
+  printf("Test #4. Expect: 2\n");
+  sem = co_sem_new(2);
+  co_waitgroup_add(wg, 8);
+  for (int i = 0; i < 8; i++) {
+    cos[i] = co_start("limited", limited, NULL);
+  }
+  co_waitgroup_wait(wg);
+  printf("%d\n", max_inside);
+  assert(max_inside == 2 && inside == 0);
+  int waits[3];
+  for (int i = 0; i < 3; i++) {
+    waits[i] = co_sem_trywait(sem);
+  }
+  assert(waits[0] == 0 && waits[1] == 0 && waits[2] == -1);
+  co_sem_post(sem);
+  co_sem_post(sem);
+  for (int i = 0; i < 8; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  co_sem_free(sem);
+  co_waitgroup_free(wg);
+  return 0;
+}
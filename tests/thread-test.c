@@ -0,0 +1,54 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "coroutine.h"
+
+enum { THREADS = 4, WORKERS = 8, ROUNDS = 1000 };
+
+struct shard {
+  int count; // only touched by the coroutines of one thread
+  co_scheduler_t *sched;
+};
+
+static void work(void *arg) {
+  struct shard *shard = arg;
+  for (int i = 0; i < ROUNDS; i++) {
+    co_scheduler_t *sched = co_scheduler_self();
+    assert(sched == shard->sched);
+    shard->count++;
+    co_yield();
+  }
+}
+
+static void *thread_main(void *arg) {
+  struct shard *shard = arg;
+  shard->sched = co_scheduler_self();
+  coroutine_t *cos[WORKERS];
+  for (int i = 0; i < WORKERS; i++) {
+    cos[i] = co_start("worker", work, shard);
+  }
+  for (int i = 0; i < WORKERS; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  return NULL;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  printf("Test #1. Expect: every thread runs its own coroutines\n");
+  pthread_t threads[THREADS];
+  struct shard shards[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    shards[i].count = 0;
+    pthread_create(&threads[i], NULL, thread_main, &shards[i]);
+  }
+  thread_main(&(struct shard) {0});
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    assert(shards[i].count == WORKERS * ROUNDS);
+    printf("%d ", shards[i].count);
+  }
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "coroutine.h"
+
+enum { MS = 1000000, SLEEPERS = 10000 };
+
+static long cpu_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int order[3];
+static int woken;
+
+static void sleeper(void *arg) {
+  int ms = (int) (long) arg;
+  co_sleep_ns((uint64_t) ms * MS);
+  order[woken++] = ms;
+}
+
+static void nap(void *arg) {
+  co_sleep_ns((uint64_t) (long) arg * MS);
+}
+
+struct deadline {
+  long wake;
+  int ms;
+};
+
+static int late;
+
+static void check(void *arg) {
+  struct deadline *d = arg;
+  co_sleep_ns((uint64_t) d->ms * MS);
+  if (now_ms() < d->wake) {
+    late = -1; // woken up early
+  }
+}
+
+static int waits[2];
+
+static void timed_waiter(void *arg) {
+  coroutine_t *co = co_start("nap", nap, (void *) 100);
+  waits[0] = co_wait_timeout(co, 20 * MS);
+  waits[1] = co_wait_timeout(co, 1000 * MS);
+  co_free(co);
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+
+  printf("Test #1. Expect: 10 20 30\n");
+  coroutine_t *cos[3];
+  cos[0] = co_start("sleeper", sleeper, (void *) 30);
+  cos[1] = co_start("sleeper", sleeper, (void *) 10);
+  cos[2] = co_start("sleeper", sleeper, (void *) 20);
+  for (int i = 0; i < 3; i++) {
+    co_wait(cos[i]);
+    co_free(cos[i]);
+  }
+  assert(order[0] == 10 && order[1] == 20 && order[2] == 30);
+  printf("%d %d %d\n", order[0], order[1], order[2]);
+
+  printf("Test #2. Expect: main sleeps for 50ms\n");
+  long start = now_ms();
+  co_sleep_ns(50 * MS); // nothing else to run, the scheduler sleeps until the timer expires
+  long elapsed = now_ms() - start;
+  assert(elapsed >= 50 && elapsed < 500);
+  printf("main sleeps for 50ms\n");
+
+  printf("Test #3. Expect: -1 0 0\n");
+  coroutine_t *co = co_start("nap", nap, (void *) 100);
+  int r1 = co_wait_timeout(co, 20 * MS);
+  int r2 = co_wait_timeout(co, 1000 * MS); // crosses a span of the first level
+  int r3 = co_wait_timeout(co, 1000 * MS);
+  co_free(co);
+  co = co_start("nap", nap, (void *) 0);
+  int r4 = co_wait_timeout(co, 3600000ull * MS); // cancelled from a high level
+  assert(r4 == 0);
+  co_free(co);
+  assert(r1 == -1 && r2 == 0 && r3 == 0);
+  printf("%d %d %d\n", r1, r2, r3);
+
+  printf("Test #4. Expect: %d sleepers woken up in time\n", SLEEPERS);
+  coroutine_t **many = malloc(sizeof(coroutine_t *) * SLEEPERS);
+  struct deadline *deadlines = malloc(sizeof(struct deadline) * SLEEPERS);
+  srand(1);
+  start = now_ms();
+  for (int i = 0; i < SLEEPERS; i++) {
+    deadlines[i].ms = rand() % 300;
+    deadlines[i].wake = start + deadlines[i].ms;
+    many[i] = co_start("check", check, &deadlines[i]);
+  }
+  for (int i = 0; i < SLEEPERS; i++) {
+    co_wait(many[i]);
+    co_free(many[i]);
+  }
+  free(deadlines);
+  free(many);
+  assert(late == 0);
+  printf("%d sleepers woken up in time\n", SLEEPERS);
+
+  printf("Test #5. Expect: -1 0, runtime coroutines wait in time while their workers idle\n");
+  co_runtime_start(2);
+  long cpu = cpu_ms();
+  coroutine_t *waiter = co_start("timed_waiter", timed_waiter, NULL);
+  coroutine_t *checks[100];
+  deadlines = malloc(sizeof(struct deadline) * 100);
+  start = now_ms();
+  for (int i = 0; i < 100; i++) {
+    deadlines[i].ms = rand() % 300;
+    deadlines[i].wake = start + deadlines[i].ms;
+    checks[i] = co_start("check", check, &deadlines[i]);
+  }
+  co_runtime_stop();
+  cpu = cpu_ms() - cpu;
+  co_free(waiter);
+  for (int i = 0; i < 100; i++) {
+    co_free(checks[i]);
+  }
+  free(deadlines);
+  printf("%d %d, %ldms of CPU\n", waits[0], waits[1], cpu);
+  assert(waits[0] == -1 && waits[1] == 0 && late == 0 && cpu < 100);
+  return 0;
+}
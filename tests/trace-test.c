@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "coroutine.h"
+
+static void yielder(void *arg) {
+  for (int i = 0; i < (int) (long) arg; i++) {
+    co_yield();
+  }
+}
+
+// Counts the occurrences of pattern in the file at path.
+static int count(const char *path, const char *pattern) {
+  static char buf[1 << 16];
+  FILE *f = fopen(path, "r");
+  assert(f != NULL);
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  int found = 0;
+  for (char *p = buf; (p = strstr(p, pattern)) != NULL; p++) {
+    found++;
+  }
+  return found;
+}
+
+int main() {
+  freopen("test.out", "w", stdout);
+  if (co_trace_start(1024) != 0) {
+    printf("Tracing is compiled out\n");
+    return 0;
+  }
+
+  // main waits for ping, ping and pong yield to each other twice and exit, then main runs again
+  printf("Test #1. Expect: 3 names, 1 wait, 4 yields, 2 exits\n");
+  coroutine_t *ping = co_start("ping", yielder, (void *) 2);
+  coroutine_t *pong = co_start("pong", yielder, (void *) 2);
+  co_wait(ping);
+  co_wait(pong);
+  int rc = co_trace_export("trace.json");
+  assert(rc == 0);
+  printf("%d names, %d wait, %d yields, %d exits\n", count("trace.json", "\"thread_name\""),
+         count("trace.json", "\"out\": \"wait\""), count("trace.json", "\"out\": \"yield\""),
+         count("trace.json", "\"out\": \"exit\""));
+  assert(count("trace.json", "\"out\": \"wait\"") == 1 && count("trace.json", "\"out\": \"yield\"") == 4);
+  assert(count("trace.json", "\"out\": \"exit\"") == 2 && count("trace.json", "\"out\": \"running\"") == 1);
+  co_free(ping);
+  co_free(pong);
+
+  // the oldest events are overwritten
+  printf("Test #2. Expect: 64 runs\n");
+  co_trace_start(64);
+  ping = co_start("ping", yielder, (void *) 1000);
+  pong = co_start("pong", yielder, (void *) 1000);
+  co_wait(ping);
+  co_wait(pong);
+  co_free(ping);
+  co_free(pong);
+  rc = co_trace_export("trace.json");
+  assert(rc == 0);
+  printf("%d runs\n", count("trace.json", "\"ph\": \"X\""));
+  assert(count("trace.json", "\"ph\": \"X\"") == 64);
+  co_trace_stop();
+  rc = co_trace_export("trace.json");
+  assert(rc == -1);
+  return 0;
+}